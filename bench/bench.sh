@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+
+# End-to-end throughput benchmark for ts.
+#
+# $ bench/bench.sh <ts-binary> <corpus-dir> [runs]
+#
+# The corpus directory is populated by `make bench` using ts-corpus;
+# each family is a file named <family>.log. Every case is run `runs`
+# times and the fastest wall-clock run is reported, together with the
+# CPU time (user + sys) of that run. The --output cases write to a
+# scratch file that is removed before every run.
+
+set -euo pipefail
+
+if [[ $# -lt 2 ]]; then
+    echo "Usage: $0 <ts-binary> <corpus-dir> [runs]" >&2
+    exit 1
+fi
+
+TS=$1
+CORPUS_DIR=$2
+RUNS=${3:-3}
+
+TIMEFORMAT='%R %U %S'
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+OUTPUT=$SCRATCH/output.log
+
+declare -A corpus_lines
+
+lines_in() {
+    local corpus=$1
+    if [[ -z "${corpus_lines[$corpus]:-}" ]]; then
+        corpus_lines[$corpus]=$(wc -l < "$corpus")
+    fi
+    echo "${corpus_lines[$corpus]}"
+}
+
+# bench_case <name> <family> [ts-args...]
+bench_case() {
+    local name=$1 family=$2
+    shift 2
+
+    local corpus="$CORPUS_DIR/$family.log"
+    local bytes lines best="" best_cpu=""
+    bytes=$(wc -c < "$corpus")
+    lines=$(lines_in "$corpus")
+
+    for ((i = 0; i < RUNS; i++)); do
+        local real user sys
+        rm -f "$OUTPUT"
+        read -r real user sys < <({ time "$TS" "$@" < "$corpus" > /dev/null; } 2>&1)
+        if [[ -z "$best" ]] || awk -v a="$real" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$real
+            best_cpu=$(awk -v u="$user" -v s="$sys" 'BEGIN { printf "%.3f", u + s }')
+        fi
+    done
+
+    awk -v name="$name" -v family="$family" -v real="$best" -v cpu="$best_cpu" \
+        -v lines="$lines" -v bytes="$bytes" 'BEGIN {
+            if (real <= 0) real = 0.001;
+            printf "| %-22s | %-8s | %8.3f | %8.3f | %12.0f | %9.1f |\n",
+                name, family, real, cpu, lines / real, bytes / 1048576 / real
+        }'
+}
+
+printf "| %-22s | %-8s | %8s | %8s | %12s | %9s |\n" "case" "corpus" "wall s" "cpu s" "lines/s" "MiB/s"
+printf "|%s|%s|%s|%s|%s|%s|\n" "------------------------" "----------" "----------" "----------" "--------------" "-----------"
+
+bench_case "default" mixed
+bench_case "hires %F %.T" mixed "%F %.T"
+bench_case "hires %.s" mixed "%.s"
+bench_case "incremental -i" mixed -i
+bench_case "since start -s" mixed -s
+bench_case "since start -s %.S" mixed -s "%.S"
+bench_case "monotonic -m" mixed -m
+bench_case "monotonic -m %FT%.T" mixed -m "%FT%.T"
+
+for corpus in "$CORPUS_DIR"/*.log; do
+    family=$(basename "$corpus" .log)
+    bench_case "relative -r" "$family" -r
+done
+
+bench_case "relative -r %F %T" mixed -r "%F %T"
+
+bench_case "filter --match" mixed --match 'error|failed'
+bench_case "filter --exclude" mixed --exclude 'healthy'
+
+bench_case "--output" mixed --output "$OUTPUT"
+bench_case "--output --preallocate" mixed --output "$OUTPUT" --preallocate 64M
+bench_case "--output --mmap" mixed --output "$OUTPUT" --mmap
@@ -0,0 +1,120 @@
+// Copyright (C) 2023, 2024, Andrew McDermott. All rights reserved.
+
+// This file is part of the https://github.com/frobware/ts project.
+// For the full copyright and license information, please view the
+// LICENSE file that was distributed with this source code.
+
+// Synthetic log corpus generator for benchmarking and PGO training.
+//
+// The lines come from the generator behind `ts --generate` (see
+// gen_families[] in ts.c, which is compiled into this translation
+// unit). Here its clock starts at a fixed epoch and advances by a
+// pseudo-random step per line instead of following the real time, so
+// the output is a pure function of the family, the seed and the size:
+// every run (and every machine) sees byte-identical input. Embedded
+// timestamps only ever move forward so the corpus is also valid input
+// for anything that expects time-ordered logs.
+//
+// $ ts-corpus [-s seed] [-b bytes[K|M|G]] family
+
+#define main ts_main
+#include "../ts.c"
+#undef main
+
+// Fixed epoch so that the output does not depend on when it is
+// generated: Tue Nov 14 22:13:20 UTC 2023.
+#define CORPUS_EPOCH 1700000000
+
+static bool parse_size(const char *s, unsigned long long *result)
+{
+	char *endptr;
+
+	errno = 0;
+	unsigned long long value = strtoull(s, &endptr, 10);
+	if (errno != 0 || endptr == s)
+		return false;
+
+	switch (*endptr) {
+	case 'k': case 'K': value <<= 10; endptr++; break;
+	case 'm': case 'M': value <<= 20; endptr++; break;
+	case 'g': case 'G': value <<= 30; endptr++; break;
+	}
+
+	if (*endptr != '\0')
+		return false;
+
+	*result = value;
+	return true;
+}
+
+static void corpus_usage(void)
+{
+	fprintf(stderr, "Usage: ts-corpus [-s seed] [-b bytes[K|M|G]] family\n\nFamilies:\n");
+	for (size_t i = 0; i < NELEMENTS(gen_families); i++)
+		fprintf(stderr, "  %-8s %s\n", gen_families[i].name, gen_families[i].description);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long seed = 1;
+	unsigned long long nbytes = 64ULL << 20;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (!parse_size(optarg, &nbytes)) {
+				fprintf(stderr, "Error: -b %s: invalid size.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if (!parse_size(optarg, &seed)) {
+				fprintf(stderr, "Error: -s %s: invalid seed.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			corpus_usage();
+		}
+	}
+
+	if (optind + 1 != argc)
+		corpus_usage();
+
+	const struct gen_family *f = find_gen_family(argv[optind]);
+	if (f == NULL) {
+		fprintf(stderr, "Error: unknown family '%s'.\n", argv[optind]);
+		corpus_usage();
+	}
+
+	static char outbuf[1 << 20];
+	if (setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf)) != 0) {
+		perror("setvbuf");
+		exit(EXIT_FAILURE);
+	}
+
+	struct gen_state st = {
+		.rng = seed,
+		.sec = CORPUS_EPOCH,
+		.advance = true,
+	};
+	char line[GEN_HEADROOM];
+
+	for (unsigned long long written = 0; written < nbytes;) {
+		size_t n = f->fn(&st, f, line, sizeof(line));
+		if (fwrite(line, 1, n, stdout) != n) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		written += n;
+	}
+
+	if (fflush(stdout) != 0) {
+		perror("fflush");
+		exit(EXIT_FAILURE);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,346 @@
+// Copyright (C) 2023, 2024, Andrew McDermott. All rights reserved.
+
+// This file is part of the https://github.com/frobware/ts project.
+// For the full copyright and license information, please view the
+// LICENSE file that was distributed with this source code.
+
+// End-to-end stamping latency harness.
+//
+// Runs ts as a child with a pipe on either side. A producer thread
+// writes lines at a fixed rate, each carrying the CLOCK_MONOTONIC
+// time at which it was written; the main thread reads ts's output and
+// records, per line, how long it took to come out the other side.
+// Writes are paced against absolute deadlines so that a slow consumer
+// shows up as latency rather than as a lower offered rate.
+//
+// $ ts-latency [-r lines/s] [-d seconds | -n lines] [-l line-bytes]
+//              [-w warmup-lines] [-j] -- ts [ts-args...]
+//
+// A rate of 0 writes as fast as the pipe allows.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NELEMENTS(A)  (sizeof(A) / sizeof((A)[0]))
+
+// Every payload starts with this marker so that it can be found after
+// whatever prefix ts adds.
+#define MARKER "@lat "
+
+struct producer {
+	int fd;
+	double rate;
+	uint64_t nlines;
+	size_t line_bytes;
+	int error;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *produce(void *arg)
+{
+	struct producer *p = arg;
+	char *line = malloc(p->line_bytes + 64);
+	struct timespec deadline;
+	uint64_t period_ns = p->rate > 0 ? (uint64_t)(1e9 / p->rate) : 0;
+
+	if (line == NULL) {
+		p->error = ENOMEM;
+		close(p->fd);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	for (uint64_t seq = 0; seq < p->nlines; seq++) {
+		if (period_ns > 0) {
+			deadline.tv_nsec += period_ns;
+			while (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_nsec -= 1000000000;
+				deadline.tv_sec++;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+				;
+		}
+
+		size_t n = snprintf(line, p->line_bytes + 64, MARKER "%llu %llu ",
+				    (unsigned long long)seq, (unsigned long long)now_ns());
+		while (n + 1 < p->line_bytes)
+			line[n++] = 'x';
+		line[n++] = '\n';
+
+		for (size_t off = 0; off < n;) {
+			ssize_t w = write(p->fd, line + off, n - off);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				p->error = errno;
+				goto out;
+			}
+			off += w;
+		}
+	}
+
+out:
+	free(line);
+	close(p->fd);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, size_t n, double p)
+{
+	if (n == 0)
+		return 0;
+	size_t i = (size_t)(p / 100.0 * (n - 1) + 0.5);
+	return sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ts-latency [-r lines/s] [-d seconds | -n lines] [-l line-bytes] [-w warmup-lines] [-j] -- ts [ts-args...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void print_command(FILE *out, char *argv[], bool json)
+{
+	for (int i = 0; argv[i] != NULL; i++) {
+		if (!json) {
+			fprintf(out, "%s%s", i ? " " : "", argv[i]);
+			continue;
+		}
+		fputs(i ? " " : "", out);
+		for (const char *c = argv[i]; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				fputc('\\', out);
+			fputc(*c, out);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	double rate = 10000;
+	double duration = 0;
+	uint64_t nlines = 0;
+	size_t line_bytes = 128;
+	uint64_t warmup = 0;
+	bool json = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+d:jl:n:r:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'l':
+			line_bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			nlines = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'w':
+			warmup = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc || rate < 0)
+		usage();
+
+	if (nlines == 0)
+		nlines = rate > 0 ? (uint64_t)(rate * (duration > 0 ? duration : 5)) : 1000000;
+
+	if (warmup == 0)
+		warmup = nlines / 100;
+
+	if (warmup >= nlines) {
+		fprintf(stderr, "Error: warm-up (%llu) must be less than the line count (%llu).\n",
+			(unsigned long long)warmup, (unsigned long long)nlines);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t *latencies = calloc(nlines, sizeof(*latencies));
+	bool *seen = calloc(nlines, sizeof(*seen));
+	if (latencies == NULL || seen == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int to_ts[2], from_ts[2];
+	if (pipe(to_ts) != 0 || pipe(from_ts) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		dup2(to_ts[0], STDIN_FILENO);
+		dup2(from_ts[1], STDOUT_FILENO);
+		close(to_ts[0]);
+		close(to_ts[1]);
+		close(from_ts[0]);
+		close(from_ts[1]);
+		execvp(argv[optind], &argv[optind]);
+		perror(argv[optind]);
+		_exit(127);
+	}
+
+	close(to_ts[0]);
+	close(from_ts[1]);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct producer p = {
+		.fd = to_ts[1],
+		.rate = rate,
+		.nlines = nlines,
+		.line_bytes = line_bytes,
+	};
+	pthread_t producer;
+	if ((errno = pthread_create(&producer, NULL, produce, &p)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t bufsz = line_bytes * 4 + 65536;
+	char *buf = malloc(bufsz);
+	size_t head = 0, tail = 0;
+	uint64_t received = 0, malformed = 0;
+	uint64_t start_ns = now_ns();
+
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		if (head > 0) {
+			memmove(buf, buf + head, tail - head);
+			tail -= head;
+			head = 0;
+		}
+		if (tail == bufsz) {
+			// A line longer than the buffer is not ours.
+			malformed++;
+			tail = 0;
+		}
+
+		ssize_t n = read(from_ts[0], buf + tail, bufsz - tail);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		uint64_t t = now_ns();
+		tail += n;
+
+		char *nl;
+		while ((nl = memchr(buf + head, '\n', tail - head)) != NULL) {
+			*nl = '\0';
+			char *m = strstr(buf + head, MARKER);
+			unsigned long long seq, sent;
+			if (m != NULL && sscanf(m + strlen(MARKER), "%llu %llu", &seq, &sent) == 2 && seq < nlines && !seen[seq]) {
+				seen[seq] = true;
+				latencies[seq] = t - sent;
+				received++;
+			} else {
+				malformed++;
+			}
+			head = nl - buf + 1;
+		}
+	}
+
+	double elapsed = (now_ns() - start_ns) / 1e9;
+
+	pthread_join(producer, NULL);
+	close(from_ts[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	if (p.error != 0)
+		fprintf(stderr, "ts-latency: write: %s\n", strerror(p.error));
+
+	// Only lines after the warm-up count; missing lines are
+	// reported rather than silently ignored.
+	size_t n = 0;
+	for (uint64_t i = warmup; i < nlines; i++) {
+		if (seen[i])
+			latencies[n++] = latencies[i];
+	}
+	qsort(latencies, n, sizeof(*latencies), cmp_u64);
+
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+		sum += latencies[i];
+
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	static const char *const pct_name[] = { "p50", "p90", "p99", "p99.9" };
+
+	if (json) {
+		printf("{\"command\":\"");
+		print_command(stdout, &argv[optind], true);
+		printf("\",\"rate\":%.0f,\"line_bytes\":%zu,\"lines\":%llu,\"received\":%llu,\"lost\":%llu,\"malformed\":%llu,\"elapsed_s\":%.3f,\"mean_us\":%.3f",
+		       rate, line_bytes, (unsigned long long)nlines, (unsigned long long)received,
+		       (unsigned long long)(nlines - received), (unsigned long long)malformed,
+		       elapsed, n ? sum / n / 1000.0 : 0);
+		for (size_t i = 0; i < NELEMENTS(pct); i++)
+			printf(",\"%s_us\":%.3f", pct_name[i], percentile(latencies, n, pct[i]));
+		printf(",\"max_us\":%.3f}\n", n ? latencies[n - 1] / 1000.0 : 0);
+	} else {
+		printf("command: ");
+		print_command(stdout, &argv[optind], false);
+		printf("\nrate: %.0f lines/s, line: %zu bytes, lines: %llu (warm-up %llu), received: %llu, lost: %llu, malformed: %llu, elapsed: %.3fs\n",
+		       rate, line_bytes, (unsigned long long)nlines, (unsigned long long)warmup,
+		       (unsigned long long)received, (unsigned long long)(nlines - received),
+		       (unsigned long long)malformed, elapsed);
+		printf("latency (us): mean %.1f", n ? sum / n / 1000.0 : 0);
+		for (size_t i = 0; i < NELEMENTS(pct); i++)
+			printf("  %s %.1f", pct_name[i], percentile(latencies, n, pct[i]));
+		printf("  max %.1f\n", n ? latencies[n - 1] / 1000.0 : 0);
+	}
+
+	free(buf);
+	free(latencies);
+	free(seen);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || received != nlines || p.error != 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+
+# Stamping latency matrix for ts.
+#
+# $ bench/latency.sh <ts-latency-binary> <ts-binary>
+#
+# Runs ts-latency for every combination of configuration, rate and
+# line size and prints one row per run. The matrix is controlled by:
+#
+#   LATENCY_RATES    lines/s to offer            (default "1000 10000 100000")
+#   LATENCY_SIZES    bytes per line              (default "64 1024")
+#   LATENCY_SECONDS  duration of each run        (default 5)
+#   LATENCY_CONFIGS  ts arguments, one configuration per line, shell
+#                    quoted; use it to compare flush policies or I/O
+#                    settings (default: default format, hires, -m)
+
+set -euo pipefail
+
+if [[ $# -ne 2 ]]; then
+    echo "Usage: $0 <ts-latency-binary> <ts-binary>" >&2
+    exit 1
+fi
+
+LATENCY=$1
+TS=$2
+
+RATES=${LATENCY_RATES:-1000 10000 100000}
+SIZES=${LATENCY_SIZES:-64 1024}
+SECONDS_PER_RUN=${LATENCY_SECONDS:-5}
+CONFIGS=${LATENCY_CONFIGS:-$'\n'"'%F %.T'"$'\n'"-m '%FT%.T'"}
+
+status=0
+
+while IFS= read -r config; do
+    eval "args=($config)"
+    for rate in $RATES; do
+        for size in $SIZES; do
+            "$LATENCY" -r "$rate" -d "$SECONDS_PER_RUN" -l "$size" -- "$TS" "${args[@]}" || status=1
+            echo
+        done
+    done
+done <<< "$CONFIGS"
+
+exit $status
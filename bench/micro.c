@@ -0,0 +1,521 @@
+// Copyright (C) 2023, 2024, Andrew McDermott. All rights reserved.
+
+// This file is part of the https://github.com/frobware/ts project.
+// For the full copyright and license information, please view the
+// LICENSE file that was distributed with this source code.
+
+// In-process microbenchmarks for the hot functions in ts.c.
+//
+// ts.c is compiled into this translation unit (with its main()
+// renamed) so that the static functions can be called directly. Each
+// benchmark is run in batches; the fastest batch is reported, per
+// operation, as wall-clock nanoseconds and, where the kernel allows
+// it, as cycles, instructions and branch misses read from
+// perf_event_open(2). Without counters (non-Linux, containers,
+// perf_event_paranoid too high) only the clock timing is reported.
+//
+// Results are written as JSON, one benchmark per line. Given a
+// baseline file from an earlier run, each benchmark is compared
+// against it and the exit status is non-zero if any regressed by more
+// than the threshold: instructions per operation are compared when
+// both runs have counters (they are far less noisy than time),
+// otherwise nanoseconds per operation.
+//
+// $ ts-micro [-o results.json] [-b baseline.json] [-t percent] [-m ms]
+
+// syscall(2) for perf_event_open.
+#define _GNU_SOURCE
+
+#define main ts_main
+#include "../ts.c"
+#undef main
+
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Stops the compiler from proving a benchmarked result is unused.
+#define DO_NOT_OPTIMIZE(P) __asm__ __volatile__("" : : "g"(P) : "memory")
+
+enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+struct counters {
+	int fd[COUNTER_COUNT];
+	bool available;
+};
+
+struct sample {
+	double ns;
+	double counter[COUNTER_COUNT];
+};
+
+struct bench_ctx {
+	struct ts_opt opt;
+	struct ts_fmt fmt;
+	struct timespec now;
+	char line[256];
+	ssize_t line_len;
+	composite_time comp_time;
+	char buf[MIN_TIME_BUFSZ];
+	char json[6 * 256];
+};
+
+struct benchmark {
+	const char *name;
+	void (*setup)(struct bench_ctx *ctx);
+	void (*run)(struct bench_ctx *ctx, uint64_t iterations);
+};
+
+static void counters_open(struct counters *c)
+{
+	c->available = false;
+	for (size_t i = 0; i < COUNTER_COUNT; i++)
+		c->fd[i] = -1;
+
+#ifdef __linux__
+	static const uint64_t configs[COUNTER_COUNT] = {
+		[COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+		[COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+		[COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+	};
+
+	for (size_t i = 0; i < COUNTER_COUNT; i++) {
+		struct perf_event_attr attr = {
+			.type = PERF_TYPE_HARDWARE,
+			.size = sizeof(attr),
+			.config = configs[i],
+			.disabled = i == 0,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+			.read_format = PERF_FORMAT_GROUP,
+		};
+		c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : c->fd[0], 0);
+		if (c->fd[i] == -1) {
+			fprintf(stderr, "ts-micro: perf_event_open: %s; using clock timing only.\n", strerror(errno));
+			for (size_t j = 0; j < i; j++)
+				close(c->fd[j]);
+			return;
+		}
+	}
+
+	c->available = true;
+#endif
+}
+
+static void counters_close(struct counters *c)
+{
+	for (size_t i = 0; i < COUNTER_COUNT; i++) {
+		if (c->fd[i] != -1)
+			close(c->fd[i]);
+	}
+}
+
+static void counters_start(struct counters *c)
+{
+#ifdef __linux__
+	if (c->available) {
+		ioctl(c->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#else
+	(void)c;
+#endif
+}
+
+static void counters_stop(struct counters *c, struct sample *s)
+{
+#ifdef __linux__
+	if (c->available) {
+		uint64_t values[1 + COUNTER_COUNT];
+		ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		if (read(c->fd[0], values, sizeof(values)) == (ssize_t)sizeof(values) && values[0] == COUNTER_COUNT) {
+			for (size_t i = 0; i < COUNTER_COUNT; i++)
+				s->counter[i] = values[1 + i];
+			return;
+		}
+		c->available = false;
+	}
+#else
+	(void)c;
+	(void)s;
+#endif
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static struct sample run_batch(const struct benchmark *b, struct bench_ctx *ctx, struct counters *c, uint64_t iterations)
+{
+	struct sample s = { 0 };
+	struct timespec start, end;
+
+	counters_start(c);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	b->run(ctx, iterations);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	counters_stop(c, &s);
+
+	s.ns = elapsed_ns(&start, &end);
+	return s;
+}
+
+static void init_fmt(struct bench_ctx *ctx, const char *format, enum sanitise_time_format_op op)
+{
+	ctx->opt.format = format;
+	ctx->opt.flag_precision = 2;
+	ctx->opt.hires_timestamping = count_microsecond_specifiers(format) > 0;
+	ctx->fmt.opt = &ctx->opt;
+
+	if (sanitise_time_format(format, &ctx->fmt.sanitised_time_format, &ctx->fmt.n_microseconds_specifiers, op) != 0 ||
+	    validate_time_format(ctx->fmt.sanitised_time_format, &ctx->fmt.buf, &ctx->fmt.bufsz) != 0) {
+		perror("ts-micro: format");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ctx->now);
+}
+
+static void set_line(struct bench_ctx *ctx, const char *line)
+{
+	ctx->line_len = snprintf(ctx->line, sizeof(ctx->line), "%s", line);
+}
+
+static void setup_fmt_time_now_default(struct bench_ctx *ctx)
+{
+	init_fmt(ctx, "%b %d %H:%M:%S", EXPAND_MICROSECOND_SPECIFIERS);
+}
+
+static void setup_fmt_time_now_hires(struct bench_ctx *ctx)
+{
+	init_fmt(ctx, "%F %.T", EXPAND_MICROSECOND_SPECIFIERS);
+}
+
+static void run_fmt_time_now(struct bench_ctx *ctx, uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		fmt_time_now(&ctx->fmt, ctx->now);
+		DO_NOT_OPTIMIZE(ctx->fmt.buf);
+	}
+}
+
+static void setup_fmt_time_rel_first(struct bench_ctx *ctx)
+{
+	init_fmt(ctx, "%b %d %H:%M:%S", COLLAPSE_MICROSECOND_SPECFIERS);
+	set_line(ctx, "2023-02-01T12:34:56.123456789Z - Kubernetes pod log entry with timestamp\n");
+}
+
+static void setup_fmt_time_rel_last(struct bench_ctx *ctx)
+{
+	init_fmt(ctx, "%b %d %H:%M:%S", COLLAPSE_MICROSECOND_SPECFIERS);
+	set_line(ctx, "Feb 1 12:34:56 - Syslog format with day\n");
+}
+
+static void setup_fmt_time_rel_format(struct bench_ctx *ctx)
+{
+	init_fmt(ctx, "%F %T", COLLAPSE_MICROSECOND_SPECFIERS);
+	ctx->opt.user_format_specified = true;
+	set_line(ctx, "2023-02-01T12:34:56 - ISO-8601 format\n");
+}
+
+static void run_fmt_time_rel(struct bench_ctx *ctx, uint64_t iterations)
+{
+	struct timespec parsed;
+	size_t match_end;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		fmt_time_rel(&ctx->fmt, ctx->line, ctx->line_len, &match_end, ctx->now, &parsed);
+		DO_NOT_OPTIMIZE(ctx->fmt.buf);
+	}
+}
+
+static void setup_match_timestamp_hit(struct bench_ctx *ctx)
+{
+	set_line(ctx, "Feb 1 12:34:56 - Syslog format with day\n");
+}
+
+static void setup_match_timestamp_miss(struct bench_ctx *ctx)
+{
+	set_line(ctx, "controller reconcile request accepted handler upstream watch session\n");
+}
+
+static void run_match_timestamp(struct bench_ctx *ctx, uint64_t iterations)
+{
+	size_t match_start, match_end;
+	const char *strptime_fmt;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		bool matched = match_timestamp(ctx->line, ctx->line_len, &match_start, &match_end, &strptime_fmt);
+		DO_NOT_OPTIMIZE(matched);
+	}
+}
+
+static void run_approximate_time(struct bench_ctx *ctx, uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		COMP_TIME_INIT(ctx->comp_time, 1, 364, 23, 59, 59);
+		DO_NOT_OPTIMIZE(ctx->comp_time);
+		approximate_time(2, ctx->comp_time);
+		DO_NOT_OPTIMIZE(ctx->comp_time);
+	}
+}
+
+static void run_format_comp_time(struct bench_ctx *ctx, uint64_t iterations)
+{
+	COMP_TIME_INIT(ctx->comp_time, 32, 131, 7, 29, 35);
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		DO_NOT_OPTIMIZE(ctx->comp_time);
+		format_comp_time(ctx->buf, ctx->comp_time, " ago", 4);
+		DO_NOT_OPTIMIZE(ctx->buf);
+	}
+}
+
+static void run_write_ull_padded(struct bench_ctx *ctx, uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		unsigned long long value = i % 1000000;
+		DO_NOT_OPTIMIZE(value);
+		write_ull_padded(ctx->buf, 0, value, 6);
+		DO_NOT_OPTIMIZE(ctx->buf);
+	}
+}
+
+static void setup_json_escape_ascii(struct bench_ctx *ctx)
+{
+	set_line(ctx, "I1102 15:04:05.123456   12345 controller.go:123] Reconciled object namespace=default name=web-7d4b9c replicas=3 took=1.2ms");
+}
+
+static void setup_json_escape_mixed(struct bench_ctx *ctx)
+{
+	set_line(ctx, "{\"level\":\"info\",\"path\":\"C:\\logs\\app\",\"msg\":\"caf\xc3\xa9 \xe2\x82\xac \xff\tbad byte\"}");
+}
+
+static void run_json_escape(struct bench_ctx *ctx, uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		DO_NOT_OPTIMIZE(ctx->line);
+		json_escape(ctx->json, ctx->line, ctx->line_len);
+		DO_NOT_OPTIMIZE(ctx->json);
+	}
+}
+
+static const struct benchmark benchmarks[] = {
+	{ "fmt_time_now/default", setup_fmt_time_now_default, run_fmt_time_now },
+	{ "fmt_time_now/hires", setup_fmt_time_now_hires, run_fmt_time_now },
+	{ "fmt_time_rel/first_pattern", setup_fmt_time_rel_first, run_fmt_time_rel },
+	{ "fmt_time_rel/last_pattern", setup_fmt_time_rel_last, run_fmt_time_rel },
+	{ "fmt_time_rel/format", setup_fmt_time_rel_format, run_fmt_time_rel },
+	{ "match_timestamp/hit", setup_match_timestamp_hit, run_match_timestamp },
+	{ "match_timestamp/miss", setup_match_timestamp_miss, run_match_timestamp },
+	{ "approximate_time", NULL, run_approximate_time },
+	{ "format_comp_time", NULL, run_format_comp_time },
+	{ "write_ull_padded", NULL, run_write_ull_padded },
+	{ "json_escape/ascii", setup_json_escape_ascii, run_json_escape },
+	{ "json_escape/mixed", setup_json_escape_mixed, run_json_escape },
+};
+
+// Picks an iteration count so that a batch takes roughly min_ms,
+// then keeps the fastest of several batches.
+static struct sample measure(const struct benchmark *b, struct bench_ctx *ctx, struct counters *c, double min_ms, uint64_t *iterations)
+{
+	uint64_t n = 1;
+	struct sample s;
+
+	for (;;) {
+		s = run_batch(b, ctx, c, n);
+		if (s.ns >= min_ms * 1e6 / 10 || n >= (1ULL << 40))
+			break;
+		n *= 2;
+	}
+
+	n = (uint64_t)(n * (min_ms * 1e6 / (s.ns > 0 ? s.ns : 1)));
+	if (n == 0)
+		n = 1;
+
+	struct sample best = run_batch(b, ctx, c, n);
+	for (int i = 0; i < 4; i++) {
+		s = run_batch(b, ctx, c, n);
+		if (s.ns < best.ns)
+			best = s;
+	}
+
+	best.ns /= n;
+	for (size_t i = 0; i < COUNTER_COUNT; i++)
+		best.counter[i] /= n;
+
+	*iterations = n;
+	return best;
+}
+
+static void print_result(FILE *out, const char *name, const struct sample *s, uint64_t iterations, bool counters)
+{
+	fprintf(out, "{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.3f", name, (unsigned long long)iterations, s->ns);
+	if (counters) {
+		fprintf(out, ",\"cycles_per_op\":%.3f,\"instructions_per_op\":%.3f,\"branch_misses_per_op\":%.4f",
+			s->counter[COUNTER_CYCLES],
+			s->counter[COUNTER_INSTRUCTIONS],
+			s->counter[COUNTER_BRANCH_MISSES]);
+	}
+	fprintf(out, "}\n");
+}
+
+// Extracts a numeric field from one of our own result lines.
+static bool json_number(const char *line, const char *key, double *value)
+{
+	char needle[64];
+	snprintf(needle, sizeof(needle), "\"%s\":", key);
+	const char *p = strstr(line, needle);
+	if (p == NULL)
+		return false;
+	*value = strtod(p + strlen(needle), NULL);
+	return true;
+}
+
+static bool baseline_lookup(FILE *baseline, const char *name, char *line, size_t linesz)
+{
+	char needle[128];
+	snprintf(needle, sizeof(needle), "\"name\":\"%s\"", name);
+	rewind(baseline);
+	while (fgets(line, linesz, baseline) != NULL) {
+		if (strstr(line, needle) != NULL)
+			return true;
+	}
+	return false;
+}
+
+// Returns true if the result regressed against the baseline.
+static bool compare_result(FILE *baseline, const char *name, const struct sample *s, bool counters, double threshold)
+{
+	char line[1024];
+	double base;
+	double current;
+	const char *metric;
+
+	if (!baseline_lookup(baseline, name, line, sizeof(line))) {
+		fprintf(stderr, "%-28s no baseline\n", name);
+		return false;
+	}
+
+	if (counters && json_number(line, "instructions_per_op", &base)) {
+		metric = "instructions/op";
+		current = s->counter[COUNTER_INSTRUCTIONS];
+	} else if (json_number(line, "ns_per_op", &base)) {
+		metric = "ns/op";
+		current = s->ns;
+	} else {
+		fprintf(stderr, "%-28s malformed baseline\n", name);
+		return false;
+	}
+
+	double change = base > 0 ? (current - base) * 100.0 / base : 0;
+	bool regressed = change > threshold;
+
+	fprintf(stderr, "%-28s %-16s %12.3f -> %12.3f (%+6.1f%%)%s\n",
+		name, metric, base, current, change, regressed ? "  REGRESSION" : "");
+
+	return regressed;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output_path = NULL;
+	const char *baseline_path = NULL;
+	double threshold = 10.0;
+	double min_ms = 50.0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:m:o:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 'm':
+			min_ms = strtod(optarg, NULL);
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: ts-micro [-o results.json] [-b baseline.json] [-t percent] [-m ms]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (min_ms <= 0) {
+		fprintf(stderr, "Error: -m must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *out = stdout;
+	if (output_path != NULL && (out = fopen(output_path, "w")) == NULL) {
+		perror(output_path);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *baseline = NULL;
+	if (baseline_path != NULL && (baseline = fopen(baseline_path, "r")) == NULL) {
+		perror(baseline_path);
+		exit(EXIT_FAILURE);
+	}
+
+	must_init_timestamp_patterns();
+	tzset();
+
+	struct counters c;
+	counters_open(&c);
+
+	int regressions = 0;
+
+	for (size_t i = 0; i < NELEMENTS(benchmarks); i++) {
+		struct bench_ctx ctx = { 0 };
+		uint64_t iterations;
+
+		if (benchmarks[i].setup != NULL)
+			benchmarks[i].setup(&ctx);
+
+		struct sample s = measure(&benchmarks[i], &ctx, &c, min_ms, &iterations);
+		print_result(out, benchmarks[i].name, &s, iterations, c.available);
+
+		if (baseline != NULL && compare_result(baseline, benchmarks[i].name, &s, c.available, threshold))
+			regressions++;
+
+		free(ctx.fmt.sanitised_time_format);
+		free(ctx.fmt.buf);
+	}
+
+	counters_close(&c);
+
+	for (size_t i = 0; i < NELEMENTS(timestamps); i++) {
+		pcre2_code_free(timestamps[i].pcre);
+		pcre2_match_data_free(timestamps[i].match_data);
+	}
+
+	if (baseline != NULL)
+		fclose(baseline);
+
+	if (out != stdout && fclose(out) != 0) {
+		perror(output_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (regressions > 0) {
+		fprintf(stderr, "%d benchmark(s) regressed by more than %.1f%%.\n", regressions, threshold);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -4,17 +4,17 @@ stdenv.mkDerivation {
   name = "ts";
   src = ./.;
 
-  buildInputs = [ pkgs.pcre2 ];
+  buildInputs = [ pkgs.pcre2 pkgs.zlib pkgs.zstd ];
   nativeBuildInputs = [ pkgs.installShellFiles pkgs.pkg-config ];
 
   buildPhase = ''
     make clean
-    make
+    make USE_ZLIB=1 USE_ZSTD=1
   '';
 
   installPhase = ''
     mkdir -p $out/bin
-    make INSTALL_BINDIR=$out/bin install
+    make USE_ZLIB=1 USE_ZSTD=1 INSTALL_BINDIR=$out/bin install
     mkdir -p $out/share/man/man1
     cp ./share/man/man1/ts.1 $out/share/man/man1/ts.1
     sed -i "s/@VERSION@/1.0/g" $out/share/man/man1/ts.1
@@ -7,25 +7,159 @@
 // Feature test macro to enable clock_gettime.
 #define _POSIX_C_SOURCE 200809L
 
-// Feature test macro to enable strptime.
-#define _XOPEN_SOURCE
+// Feature test macro to enable strptime and posix_openpt.
+#define _XOPEN_SOURCE 700
+
+// Feature test macro to enable fallocate on Linux.
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#ifdef TS_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef TS_ZSTD
+#include <zstd.h>
+#endif
+
 #define NELEMENTS(A)  (sizeof(A) / sizeof((A)[0]))
 
+// Statically defined tracepoints (USDT) on the per-line path. Built
+// with `make USE_USDT=1` each probe compiles to a single nop plus an
+// ELF note that bpftrace(8), perf(1) and friends can attach to at
+// runtime; without it the probes vanish entirely and the default
+// binary is unchanged.
+//
+// Probes (provider "ts"):
+//   line_read(len)                 - a line has been read.
+//   clock_read(sec, nsec)          - the timestamp for the line.
+//   match_start(pattern)           - before matching timestamps[pattern].
+//   match_end(pattern, rc)         - after matching; rc < 0 is no match.
+//   format_done(buf)               - the prefix has been formatted.
+//   write_done(rc)                 - the stamped line has been written.
+//   lines_dropped(lines, bytes)    - --lossy dropped this many lines
+//                                    since the last report.
+#ifdef TS_USDT
+#include <sys/sdt.h>
+#define TS_PROBE1(NAME, A)		DTRACE_PROBE1(ts, NAME, A)
+#define TS_PROBE2(NAME, A, B)		DTRACE_PROBE2(ts, NAME, A, B)
+#else
+#define TS_PROBE1(NAME, A)		do { (void)(A); } while (0)
+#define TS_PROBE2(NAME, A, B)		do { (void)(A); (void)(B); } while (0)
+#endif
+
+// Allocation checking for the steady state. Built with
+// -DTS_ALLOC_CHECK (see `make alloc-check`) malloc(3) and friends are
+// interposed and counted once ALLOC_CHECK_WARMUP_LINES lines have
+// been stamped; any allocation or free after that point is reported
+// and ts exits non-zero. Only the stamping thread is checked: the
+// compression threads set up and tear down their state once per
+// stream, which may well end before stamping does. This relies on
+// glibc's __libc_malloc() et al. and is only meant for testing.
+#ifdef TS_ALLOC_CHECK
+#define ALLOC_CHECK_WARMUP_LINES 1024
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static _Thread_local bool alloc_check_armed;
+static unsigned long long alloc_check_lines;
+static unsigned long long alloc_check_count;
+
+void *malloc(size_t size)
+{
+	alloc_check_count += alloc_check_armed;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_check_count += alloc_check_armed;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_check_count += alloc_check_armed;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	alloc_check_count += alloc_check_armed && ptr != NULL;
+	__libc_free(ptr);
+}
+
+static void alloc_check_line(void)
+{
+	if (++alloc_check_lines == ALLOC_CHECK_WARMUP_LINES)
+		alloc_check_armed = true;
+}
+
+static bool alloc_check_done(void)
+{
+	alloc_check_armed = false;
+
+	if (alloc_check_lines < ALLOC_CHECK_WARMUP_LINES) {
+		fprintf(stderr, "alloc-check: only %llu lines; need more than %d to warm up.\n",
+			alloc_check_lines, ALLOC_CHECK_WARMUP_LINES);
+		return false;
+	}
+
+	if (alloc_check_count > 0) {
+		fprintf(stderr, "alloc-check: %llu allocations after %d warm-up lines.\n",
+			alloc_check_count, ALLOC_CHECK_WARMUP_LINES);
+		return false;
+	}
+
+	return true;
+}
+
+#define ALLOC_CHECK_LINE()	alloc_check_line()
+#define ALLOC_CHECK_STOP()	(alloc_check_armed = false)
+#define ALLOC_CHECK_DONE()	alloc_check_done()
+#else
+#define ALLOC_CHECK_LINE()	do { } while (0)
+#define ALLOC_CHECK_STOP()	do { } while (0)
+#define ALLOC_CHECK_DONE()	true
+#endif
+
 // MIN_TIME_BUFSZ - The minimum buffer size for formatting
 // relative time differences.
 //
@@ -57,6 +191,13 @@
 #define MAX_TIME_BUFSZ 4096
 #endif
 
+// LINE_BUFSZ - The initial size of the input buffer. It is allocated
+// once at startup and only grows, by doubling, for a line that does
+// not fit; typical log lines never cause an allocation while stamping.
+#ifndef LINE_BUFSZ
+#define LINE_BUFSZ (64 * 1024)
+#endif
+
 #define COMP_TIME_INIT(COMP_TIME, Y, D, H, M, S)	\
 	do {						\
 		(COMP_TIME)[YEAR_UNIT] = (Y);		\
@@ -89,12 +230,83 @@ enum sanitise_time_format_op {
 	EXPAND_MICROSECOND_SPECIFIERS,
 };
 
+struct shard_set;
+
 struct ts_fmt {
 	struct ts_opt *opt;
 	char *sanitised_time_format;
 	size_t n_microseconds_specifiers;
 	char *buf;
 	size_t bufsz;
+	uint64_t seq;		// Of the next --binary or --json record.
+	char *json;		// --json output buffer.
+	size_t jsonsz;
+	struct shard_set *shards;	// --shard files.
+	struct timespec shard_time;	// Of the last line stamped.
+	pcre2_code **match;		// --match patterns.
+	pcre2_code **exclude;		// --exclude patterns.
+	pcre2_match_data *filter_data;
+	bool filtered;			// The last line was filtered out.
+};
+
+enum gen_profile {
+	GEN_CONSTANT,
+	GEN_POISSON,
+	GEN_BURST,
+};
+
+struct gen_family;
+
+// Settings for --generate.
+struct gen_opt {
+	const struct gen_family *family;	// NULL unless generating.
+	double rate;				// Lines per second; 0 is unpaced.
+	enum gen_profile profile;
+	unsigned long long burst;		// Lines per burst.
+	size_t len_min;				// Line length, excluding the
+	size_t len_max;				// newline; 0 to vary by family.
+	unsigned long long count;		// 0 is unlimited.
+	int64_t duration;			// Nanoseconds; 0 is unlimited.
+	uint64_t seed;
+};
+
+// Binary records (--binary). The stream starts with BINARY_MAGIC, a
+// version byte and a byte of BINARY_* flags for the optional fields
+// that every record then has:
+//
+//   varint  length of the line, shifted left by one; the low bit is
+//           set if the record continues the line of the one before
+//           (a line split by --max-line-bytes)
+//   i64     time, in ns since the epoch (little-endian)
+//   varint  source id       (BINARY_SOURCE)
+//   varint  sequence number (BINARY_SEQ)
+//           the line, as read
+#define BINARY_MAGIC "TSREC\0"
+#define BINARY_VERSION 1
+#define BINARY_HEADER 8
+#define BINARY_SOURCE 0x01
+#define BINARY_SEQ 0x02
+#define BINARY_ON 0x80		// --binary without optional fields.
+
+// Fields of a --json object, in the order they are written.
+enum json_field {
+	JSON_TS,
+	JSON_TS_NS,
+	JSON_PARSED_NS,
+	JSON_SEQ,
+	JSON_SOURCE,
+	JSON_LINE,
+	JSON_FIELD_COUNT,
+};
+
+static const char *const json_fields[JSON_FIELD_COUNT] = {
+	"ts", "ts_ns", "parsed_ns", "seq", "source", "line",
+};
+
+enum compress {
+	COMPRESS_NONE,
+	COMPRESS_GZIP,
+	COMPRESS_ZSTD,
 };
 
 struct ts_opt {
@@ -106,6 +318,91 @@ struct ts_opt {
 	bool user_format_specified;
 	const char *format;
 	int flag_precision;
+	size_t max_line_bytes;
+	bool truncate_long_lines;
+	bool replay;
+	double replay_speed;
+	struct gen_opt gen;
+	char **command;			// ts -- command [args...]
+	const char *stream_tags[2];	// For the command's stdout, stderr.
+	bool pty;			// The command's stdout is a pty.
+	bool keep_cr;
+	char *tz;			// The caller's TZ, for the command.
+	char **inputs;			// --input specs.
+	size_t ninputs;
+	const char *split_output;	// Directory for per-input output.
+	bool merge;			// Merge the inputs by timestamp.
+	bool reorder;
+	int64_t reorder_window;		// In ns.
+	bool reorder_by_arrival;
+	size_t reorder_buffer;		// In bytes.
+	bool range;			// --from and/or --to.
+	int64_t range_from;		// In ns since the epoch.
+	int64_t range_to;
+	const char *archive;		// Capture archive to append to.
+	const char *query;		// Capture archive to query.
+	int64_t count_per;		// Interval to count lines in, in ns.
+	unsigned binary;		// Write records: BINARY_* fields, or
+					// BINARY_ON for none.
+	bool decode;			// Turn records back into text.
+	bool json;			// Write JSON lines.
+	const char *json_names[JSON_FIELD_COUNT];
+	const char *output;		// Written instead of stdout.
+	enum compress compress;
+	int compress_level;		// INT_MIN for the default.
+	size_t frame_size;		// Input bytes per compressed frame.
+	int compress_threads;		// zstd workers; 0 for none.
+	size_t rotate_size;		// In bytes; 0 for none.
+	int64_t rotate_interval;	// In ns; 0 for none.
+	unsigned rotate_keep;		// Rotated files to keep.
+	size_t preallocate;		// Extent size; 0 for none.
+	bool mmap;			// Write --output through a mapping.
+	const char *shard;		// strftime(3) template for file names.
+	unsigned shard_files;		// Shards kept open.
+	size_t ring;			// Flight recorder size; 0 for none.
+	const char *ring_dump;		// strftime(3) template for dumps.
+	const char *ring_trigger;	// Regex that triggers a dump.
+	unsigned long long ring_after;	// Lines recorded after a trigger.
+	size_t lossy;			// Output buffer to drop beyond; 0 for none.
+	const char **match;		// Keep only lines matching one of these.
+	size_t nmatch;
+	const char **exclude;		// Drop lines matching any of these.
+	size_t nexclude;
+};
+
+// Splits input from a file descriptor into lines without copying
+// them; lines point into buf and remain valid until the next call to
+// read_line().
+//
+// If max_bufsz is non-zero the buffer never grows beyond it and a
+// longer line is returned in pieces: every piece but the last has
+// fragment set, and every piece but the first has continuation set.
+struct decompressor;
+
+struct line_reader {
+	int fd;
+	char *buf;
+	size_t bufsz;
+	size_t max_bufsz;
+	size_t head;		// Start of the next line.
+	size_t scan;		// Where to resume looking for a newline.
+	size_t tail;		// End of the buffered input.
+	bool eof;
+	bool fragment;
+	bool continuation;
+	struct decompressor *decomp;	// Set when fd is decompressed input.
+};
+
+// An input to be stamped and where its lines go.
+struct stamp_source {
+	struct line_reader reader;
+	FILE *out;
+	const char *tag;	// Written after the timestamp, if set.
+	bool strip_cr;		// Turn CRLF line endings into LF.
+	unsigned id;		// Source id in --binary records.
+	struct timespec shard_time;	// Of the line being continued.
+	bool filtered;		// The line being continued was filtered out.
+	unsigned long long truncated_bytes;
 };
 
 struct timestamp_pattern {
@@ -439,7 +736,7 @@ static size_t write_ull_padded(char *buf, size_t offset, unsigned long long valu
 	temp = value;
 
 	for (int i = ndigits - 1; i >= 0; i--) {
-		buf[offset + i] = (temp % 10) + '0';
+		buf[offset + required_padding + i] = (temp % 10) + '0';
 		temp /= 10;
 	}
 
@@ -464,13 +761,192 @@ static void format_comp_time(char *buf, const composite_time comp_time, const ch
 	buf[offset] = '\0';
 }
 
+// Returns the length of the valid UTF-8 sequence at s, or 0 if there
+// is none (overlong forms, surrogates and code points past U+10FFFF
+// are not valid).
+static size_t utf8_sequence(const unsigned char *s, size_t len)
+{
+	uint32_t cp;
+	size_t n;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		n = 2;
+		cp = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		n = 3;
+		cp = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+		cp = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (len < n)
+		return 0;
+
+	for (size_t i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+
+	if ((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+	    (n == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+		return 0;
+
+	return n;
+}
+
+static bool json_plain(unsigned char c)
+{
+	return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+// Writes the escaped form of the byte(s) at s[*i], which json_plain()
+// rejected, to out and advances *i past them. Bytes that are not
+// valid UTF-8 become U+FFFD, one per byte.
+static size_t json_escape_special(char *out, const unsigned char *s, size_t len, size_t *i)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c = s[*i];
+	size_t n;
+
+	if (c >= 0x80) {
+		if ((n = utf8_sequence(s + *i, len - *i)) == 0) {
+			(*i)++;
+			memcpy(out, "\\ufffd", 6);
+			return 6;
+		}
+		memcpy(out, s + *i, n);
+		*i += n;
+		return n;
+	}
+
+	(*i)++;
+	out[0] = '\\';
+
+	switch (c) {
+	case '"': out[1] = '"'; return 2;
+	case '\\': out[1] = '\\'; return 2;
+	case '\b': out[1] = 'b'; return 2;
+	case '\f': out[1] = 'f'; return 2;
+	case '\n': out[1] = 'n'; return 2;
+	case '\r': out[1] = 'r'; return 2;
+	case '\t': out[1] = 't'; return 2;
+	}
+
+	memcpy(out + 1, "u00", 3);
+	out[4] = hex[c >> 4];
+	out[5] = hex[c & 0xf];
+	return 6;
+}
+
+// Writes s as the contents of a JSON string to out, which must have
+// room for 6 * len bytes, and returns the number of bytes written.
+// With SSE2, 16 bytes at a time are checked for anything that needs
+// escaping (a signed compare against 0x20 catches both control
+// characters and non-ASCII bytes) and copied through if there is
+// none, so that plain text costs little more than a copy.
+static size_t json_escape(char *out, const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t i = 0;
+	size_t o = 0;
+
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+					       _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		unsigned mask = _mm_movemask_epi8(special);
+
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *)(out + o), v);
+			i += 16;
+			o += 16;
+			continue;
+		}
+
+		unsigned plain = __builtin_ctz(mask);
+		memcpy(out + o, s + i, plain);
+		i += plain;
+		o += plain;
+		o += json_escape_special(out + o, s, len, &i);
+	}
+#endif
+
+	while (i < len) {
+		if (json_plain(s[i]))
+			out[o++] = s[i++];
+		else
+			o += json_escape_special(out + o, s, len, &i);
+	}
+
+	return o;
+}
+
+static void test_json_escape(void)
+{
+	static const struct {
+		const char *in;
+		const char *out;
+	} cases[] = {
+		{ "\"", "\\\"" },
+		{ "\\", "\\\\" },
+		{ "\n", "\\n" },
+		{ "\t", "\\t" },
+		{ "\x01", "\\u0001" },
+		{ "\x1f", "\\u001f" },
+		{ "\x7f", "\x7f" },
+		{ "\xc3\xa9", "\xc3\xa9" },
+		{ "\xe2\x82\xac", "\xe2\x82\xac" },
+		{ "\xf0\x9f\x98\x80", "\xf0\x9f\x98\x80" },
+		{ "\xff", "\\ufffd" },
+		{ "\xc3(", "\\ufffd(" },
+		{ "\xc0\xaf", "\\ufffd\\ufffd" },		// Overlong.
+		{ "\xed\xa0\x80", "\\ufffd\\ufffd\\ufffd" },	// Surrogate.
+		{ "\xf4\x90\x80\x80", "\\ufffd\\ufffd\\ufffd\\ufffd" }, // Past U+10FFFF.
+	};
+	enum { LEN = 40 };
+	char in[LEN], want[6 * LEN], out[6 * LEN];
+
+	// Each case goes at every offset in a run of plain text, so that
+	// it falls before, across and after the 16-byte boundaries of the
+	// SSE2 loop as well as in the scalar tail.
+	for (size_t c = 0; c < NELEMENTS(cases); c++) {
+		size_t in_len = strlen(cases[c].in);
+		size_t out_len = strlen(cases[c].out);
+
+		for (size_t pad = 0; pad + in_len <= LEN; pad++) {
+			size_t rest = LEN - pad - in_len;
+
+			memset(in, 'a', LEN);
+			memcpy(in + pad, cases[c].in, in_len);
+			memset(want, 'a', pad);
+			memcpy(want + pad, cases[c].out, out_len);
+			memset(want + pad + out_len, 'a', rest);
+
+			size_t n = json_escape(out, in, LEN);
+			assert(n == pad + out_len + rest && memcmp(out, want, n) == 0);
+		}
+	}
+}
+
 static bool match_timestamp(char *subject, ssize_t len, size_t *match_start, size_t *match_end, const char **strptime_fmt)
 {
 	*match_start = *match_end = 0;
 	*strptime_fmt = NULL;
 
 	for (size_t i = 0; i < NELEMENTS(timestamps); i++) {
-                if (pcre2_match(timestamps[i].pcre, (PCRE2_SPTR)subject, len, 0, 0, timestamps[i].match_data, NULL) < 0)
+		TS_PROBE1(match_start, i);
+		int rc = pcre2_match(timestamps[i].pcre, (PCRE2_SPTR)subject, len, 0, 0, timestamps[i].match_data, NULL);
+		TS_PROBE2(match_end, i, rc);
+		if (rc < 0)
 			continue; // No match.
 		size_t *ovector = pcre2_get_ovector_pointer(timestamps[i].match_data);
 		assert(ovector);
@@ -483,6 +959,202 @@ static bool match_timestamp(char *subject, ssize_t len, size_t *match_start, siz
 	return false;
 }
 
+// A scripted clock (--fake-clock) so that output can be made
+// deterministic. It either starts at a fixed time and moves on by a
+// fixed step at every reading, or steps through the readings listed
+// in a file, repeating the last one once the script is exhausted.
+// CLOCK_REALTIME and CLOCK_MONOTONIC read the same fake time.
+struct fake_clock {
+	bool enabled;
+	int64_t now;		// Nanoseconds.
+	int64_t step;
+	int64_t *script;
+	size_t script_len;
+	size_t script_pos;
+};
+
+static struct fake_clock fake_clock;
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * NANOSECONDS_PER_SECOND + ts->tv_nsec;
+}
+
+static struct timespec ns_to_timespec(int64_t ns)
+{
+	return (struct timespec){
+		.tv_sec = ns / NANOSECONDS_PER_SECOND,
+		.tv_nsec = ns % NANOSECONDS_PER_SECOND,
+	};
+}
+
+// Parses a non-negative number of seconds with up to nine decimal
+// places (e.g., "1700000000.25") into nanoseconds. Returns a pointer
+// just past the number, or NULL if there is none.
+static const char *parse_seconds(const char *s, int64_t *ns)
+{
+	int64_t sec = 0;
+	int64_t frac = 0;
+
+	if (*s < '0' || *s > '9')
+		return NULL;
+
+	for (; *s >= '0' && *s <= '9'; s++) {
+		if (sec > (INT64_MAX / NANOSECONDS_PER_SECOND - 9) / 10)
+			return NULL;
+		sec = sec * 10 + (*s - '0');
+	}
+
+	if (*s == '.') {
+		int64_t scale = NANOSECONDS_PER_SECOND / 10;
+		for (s++; *s >= '0' && *s <= '9'; s++, scale /= 10)
+			frac += (*s - '0') * scale;
+	}
+
+	*ns = sec * NANOSECONDS_PER_SECOND + frac;
+	return s;
+}
+
+static void load_fake_clock_script(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t linesz = 0;
+	size_t capacity = 0;
+	unsigned long lineno = 0;
+
+	if (fp == NULL) {
+		fprintf(stderr, "Error: --fake-clock %s: %s.\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&line, &linesz, fp) != -1) {
+		const char *p = line + strspn(line, " \t");
+		int64_t ns;
+
+		lineno++;
+
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		p = parse_seconds(p, &ns);
+		if (p == NULL || p[strspn(p, " \t\r\n")] != '\0') {
+			fprintf(stderr, "Error: --fake-clock %s:%lu: expected seconds since the epoch.\n", path, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		if (fake_clock.script_len == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			int64_t *script = realloc(fake_clock.script, capacity * sizeof(*script));
+			if (script == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			fake_clock.script = script;
+		}
+
+		fake_clock.script[fake_clock.script_len++] = ns;
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "Error: --fake-clock %s: %s.\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (fake_clock.script_len == 0) {
+		fprintf(stderr, "Error: --fake-clock %s: no clock readings.\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+// SPEC is either START[+STEP], in seconds since the epoch, or the
+// path of a file with one reading per line.
+static void init_fake_clock(const char *spec)
+{
+	fake_clock.enabled = true;
+
+	if (*spec < '0' || *spec > '9') {
+		load_fake_clock_script(spec);
+		fake_clock.now = fake_clock.script[0];
+		return;
+	}
+
+	const char *p = parse_seconds(spec, &fake_clock.now);
+	if (p != NULL && *p == '+')
+		p = parse_seconds(p + 1, &fake_clock.step);
+
+	if (p == NULL || *p != '\0') {
+		fprintf(stderr, "Error: --fake-clock %s: expected START[+STEP] or a file.\n", spec);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// clock_gettime(3), unless --fake-clock is in effect. A reading taken
+// with advance set moves the fake clock on to its next value.
+static int read_clock(clockid_t clock_id, struct timespec *now, bool advance)
+{
+	if (!fake_clock.enabled)
+		return clock_gettime(clock_id, now);
+
+	*now = ns_to_timespec(fake_clock.now);
+
+	if (advance) {
+		if (fake_clock.script == NULL)
+			fake_clock.now += fake_clock.step;
+		else if (fake_clock.script_pos + 1 < fake_clock.script_len)
+			fake_clock.now = fake_clock.script[++fake_clock.script_pos];
+	}
+
+	return 0;
+}
+
+// Sleeps until CLOCK_MONOTONIC reaches deadline (nanoseconds). With
+// --fake-clock the fake time simply jumps forward to the deadline.
+// Returns early, with errno set to EINTR, if stop is set by a signal.
+static int sleep_until(int64_t deadline, volatile sig_atomic_t *stop)
+{
+	if (fake_clock.enabled) {
+		if (deadline > fake_clock.now)
+			fake_clock.now = deadline;
+		return 0;
+	}
+
+	struct timespec ts = ns_to_timespec(deadline);
+	int rc;
+
+#ifdef TIMER_ABSTIME
+	while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR) {
+		if (*stop) {
+			errno = EINTR;
+			return -1;
+		}
+	}
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+#else
+	// No clock_nanosleep(2) (e.g., macOS); sleep for whatever is
+	// left until the deadline instead.
+	for (;;) {
+		struct timespec now;
+		if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+			return -1;
+		int64_t left = deadline - timespec_to_ns(&now);
+		if (left <= 0)
+			break;
+		ts = ns_to_timespec(left);
+		if ((rc = nanosleep(&ts, NULL)) != 0 && (errno != EINTR || *stop))
+			return -1;
+	}
+#endif
+
+	return 0;
+}
+
 // Calculates a timestamp based on various modes and flags. This
 // function handles both high-resolution (hires) and
 // non-high-resolution (non-hires) timestamping.
@@ -521,7 +1193,7 @@ static bool match_timestamp(char *subject, ssize_t len, size_t *match_start, siz
 //                           timestamp.
 static bool gettime(const struct ts_opt *const ts, struct timespec *now, long *last_seconds, long *last_nanoseconds, long monodelta)
 {
-	if (clock_gettime(ts->flag_mono ? CLOCK_MONOTONIC : CLOCK_REALTIME, now) != 0)
+	if (read_clock(ts->flag_mono ? CLOCK_MONOTONIC : CLOCK_REALTIME, now, true) != 0)
 		return false;
 
 	if (ts->hires_timestamping) {
@@ -555,16 +1227,25 @@ static bool gettime(const struct ts_opt *const ts, struct timespec *now, long *l
 	return true;
 }
 
-static void fmt_time_rel(struct ts_fmt *fmt, char *line, ssize_t line_len, size_t *match_end, struct timespec now)
+// Finds the first recognised timestamp in line and converts it to
+// seconds since the epoch. Sub-second digits directly after the
+// parsed fields (e.g., ".123456789") are returned in parsed->tv_nsec.
+//
+// @param line       The line; temporarily modified, but restored.
+// @param line_len   Length of the line.
+// @param now        The current time, used to resolve a missing year.
+// @param parsed_tm  Set to the broken-down time on success.
+// @param parsed     Set to the parsed time on success.
+// @param match_end  Set to the offset just past the matched timestamp,
+//                   or 0 if no timestamp was recognised.
+// @return           True if a timestamp was found and parsed.
+static bool parse_timestamp(char *line, ssize_t line_len, time_t now, struct tm *parsed_tm, struct timespec *parsed, size_t *match_end)
 {
 	size_t match_start;
 	const char *strptime_fmt = NULL;
 
-	*match_end = 0;
-	fmt->buf[0] = '\0';
-
 	if (!match_timestamp(line, line_len, &match_start, match_end, &strptime_fmt)) {
-		return;
+		return false;
 	}
 
 	// Isolate the timestamp within the line before parsing.
@@ -576,18 +1257,31 @@ static void fmt_time_rel(struct ts_fmt *fmt, char *line, ssize_t line_len, size_
 	// provided format string. This means not all fields in struct
 	// tm might be set by strptime if they're not represented in
 	// the input string.
-	struct tm parsed_tm = { 0 };
+	*parsed_tm = (struct tm){ 0 };
 
-	if (strptime(&line[match_start], strptime_fmt, &parsed_tm) == NULL) {
-		line[*match_end] = old_char;
-		return;
-	}
+	const char *rest = strptime(&line[match_start], strptime_fmt, parsed_tm);
 
 	line[*match_end] = old_char;
 
-	if (parsed_tm.tm_year == 0) {
-		struct tm *current_tm = localtime(&now.tv_sec);
-		parsed_tm.tm_year = current_tm->tm_year;
+	if (rest == NULL) {
+		return false;
+	}
+
+	parsed->tv_nsec = 0;
+
+	size_t pos = rest - line;
+	if (pos + 1 < (size_t)line_len && (line[pos] == '.' || line[pos] == ',') &&
+	    line[pos + 1] >= '0' && line[pos + 1] <= '9') {
+		long scale = NANOSECONDS_PER_SECOND / 10;
+		for (pos++; pos < (size_t)line_len && line[pos] >= '0' && line[pos] <= '9'; pos++, scale /= 10) {
+			parsed->tv_nsec += (line[pos] - '0') * scale;
+		}
+	}
+
+	if (parsed_tm->tm_year == 0) {
+		struct tm current_tm;
+		localtime_r(&now, &current_tm);
+		parsed_tm->tm_year = current_tm.tm_year;
 	}
 
 	// Convert the parsed timestamp to time_t to assess its
@@ -600,24 +1294,37 @@ static void fmt_time_rel(struct ts_fmt *fmt, char *line, ssize_t line_len, size_
 	// being in the future.
 
 	// Let mktime() determine DST.
-	parsed_tm.tm_isdst = -1;
+	parsed_tm->tm_isdst = -1;
 
-	time_t parsed_time_t = mktime(&parsed_tm);
-	if (parsed_time_t > now.tv_sec) {
-		parsed_tm.tm_year--;
+	parsed->tv_sec = mktime(parsed_tm);
+	if (parsed->tv_sec > now) {
+		parsed_tm->tm_year--;
 		// Let mktime() determine DST.
-		parsed_tm.tm_isdst = -1;
-		parsed_time_t = mktime(&parsed_tm);
+		parsed_tm->tm_isdst = -1;
+		parsed->tv_sec = mktime(parsed_tm);
+	}
+
+	return true;
+}
+
+static bool fmt_time_rel(struct ts_fmt *fmt, char *line, ssize_t line_len, size_t *match_end, struct timespec now, struct timespec *parsed)
+{
+	struct tm parsed_tm;
+
+	fmt->buf[0] = '\0';
+
+	if (!parse_timestamp(line, line_len, now.tv_sec, &parsed_tm, parsed, match_end)) {
+		return false;
 	}
 
 	if (fmt->opt->user_format_specified) {
 		strftime(fmt->buf, fmt->bufsz, fmt->sanitised_time_format, &parsed_tm);
 	} else {
-		time_t seconds_diff = difftime(now.tv_sec, parsed_time_t);
+		time_t seconds_diff = difftime(now.tv_sec, parsed->tv_sec);
 
 		if (seconds_diff == 0) {
 			snprintf(fmt->buf, fmt->bufsz, "right now");
-			return;
+			return true;
 		}
 
 		composite_time comp_time;
@@ -629,13 +1336,20 @@ static void fmt_time_rel(struct ts_fmt *fmt, char *line, ssize_t line_len, size_
 				 seconds_diff >= 0 ? " ago" : " from now",
 				 seconds_diff >= 0 ? 4 : 9);
 	}
+
+	return true;
 }
 
 static void fmt_time_now(struct ts_fmt *fmt, struct timespec now)
 {
+	struct tm tm;
+
 	*fmt->buf = '\0';
 
-	size_t n = strftime(fmt->buf, fmt->bufsz, fmt->sanitised_time_format, localtime(&now.tv_sec));
+	// localtime_r() rather than localtime(): the latter re-reads
+	// the timezone (a stat(2) of /etc/localtime in glibc) on every
+	// call. tzset() is called once at startup instead.
+	size_t n = strftime(fmt->buf, fmt->bufsz, fmt->sanitised_time_format, localtime_r(&now.tv_sec, &tm));
 
 	for (size_t i = 0; n > 0 && i < fmt->n_microseconds_specifiers; i++) {
 		char *placeholder = strstr(fmt->buf, ".000000");
@@ -645,371 +1359,5779 @@ static void fmt_time_now(struct ts_fmt *fmt, struct timespec now)
 	}
 }
 
-static void must_init_timestamp_patterns(void)
+static bool write_all(int fd, const void *buf, size_t len)
 {
-	for (size_t i = 0; i < NELEMENTS(timestamps); i++) {
-		PCRE2_SIZE offset;
-		PCRE2_SPTR pattern = (PCRE2_SPTR)timestamps[i].re;
-		int rc;
-		uint32_t options = PCRE2_UTF | PCRE2_UCP;
-
-		timestamps[i].pcre = pcre2_compile(
-			pattern,                // the pattern
-			PCRE2_ZERO_TERMINATED,  // indicates the pattern is zero-terminated
-			options,		// options
-			&rc,			// for error number
-			&offset,		// for error offset
-			NULL                    // use default compile context
-			);
-
-		if (timestamps[i].pcre == NULL) {
-			PCRE2_UCHAR buf[256];
-			pcre2_get_error_message(rc, buf, sizeof(buf));
-			fprintf(stderr, "PCRE2 compilation error for pattern#%zd: '%s', error='%s', offset=%ld.\n", i, timestamps[i].re, buf, offset);
-			exit(EXIT_FAILURE);
-		}
+	const char *p = buf;
 
-		timestamps[i].match_data = pcre2_match_data_create_from_pattern(timestamps[i].pcre, NULL);
-		if (timestamps[i].match_data == NULL) {
-			fprintf(stderr, "Failed to create match data for pattern %zu\n", i);
-			exit(EXIT_FAILURE);
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
 		}
+		p += n;
+		len -= n;
 	}
+
+	return true;
 }
 
-static bool init_clocks(const struct ts_opt *const ts, long *last_seconds, long *last_nanoseconds, long *monodelta)
+// Starts a helper thread with every signal blocked, so that signals
+// keep interrupting the main thread, which is what checks
+// signal_received. Returns 0 or an errno value.
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
 {
-	struct timespec now;
-
-	if (clock_gettime(CLOCK_REALTIME, &now) != 0) {
-		return false;
-	}
+	sigset_t all, old;
 
-	*last_seconds = now.tv_sec;
-	*last_nanoseconds = ts->hires_timestamping ? now.tv_nsec : 0;
-	*monodelta = 0;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int rc = pthread_create(thread, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-	if (ts->flag_mono) {
-		struct timespec real_time;
-		if (clock_gettime(CLOCK_MONOTONIC, &real_time) != 0) {
-			return false;
-		}
+	return rc;
+}
+
+static void ignore_signal(int sig)
+{
+	(void)sig;
+}
+
+// Makes stdout the write end of a new pipe and returns the read end,
+// for a thread that stands in for whatever stdout was (--output,
+// --ring, --lossy).
+//
+// SIGPIPE is caught, so that once the thread has given up, writes to
+// the pipe fail with EPIPE and ts reports the error and exits
+// non-zero instead of being killed. It is caught rather than ignored
+// because a command run by ts would inherit SIG_IGN across exec.
+static int stdout_pipe(void)
+{
+	struct sigaction sa = { .sa_handler = ignore_signal, .sa_flags = SA_RESTART };
+	int fds[2];
+
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipe(fds) != 0 || fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	    dup2(fds[1], STDOUT_FILENO) < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	close(fds[1]);
+
+	return fds[0];
+}
+
+// A self-pipe through which handler, installed for sig, wakes a
+// thread polling wake[0]. wake is the handler's global, so it is set
+// before the handler can run.
+static void wake_pipe_open(int wake[2], int sig, void (*handler)(int))
+{
+	struct sigaction sa = { .sa_handler = handler, .sa_flags = SA_RESTART };
+
+	if (pipe(wake) != 0 ||
+	    fcntl(wake[0], F_SETFD, FD_CLOEXEC) != 0 || fcntl(wake[0], F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(wake[1], F_SETFD, FD_CLOEXEC) != 0 || fcntl(wake[1], F_SETFL, O_NONBLOCK) != 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(sig, &sa, NULL) == -1) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Wakes the thread; called from the signal handler.
+static void wake_pipe_poke(const int wake[2])
+{
+	int saved_errno = errno;
+
+	if (write(wake[1], "", 1) < 0) {
+		// The pipe is full, so the thread is waking up anyway.
+	}
+	errno = saved_errno;
+}
+
+static void wake_pipe_drain(const int wake[2])
+{
+	char buf[64];
+
+	if (read(wake[0], buf, sizeof(buf)) < 0) {
+		// Nothing to drain after all.
+	}
+}
+
+// Closes the pipe. A signal that still arrives writes to -1 and is
+// ignored.
+static void wake_pipe_close(int wake[2])
+{
+	int fd = wake[1];
+
+	wake[1] = -1;
+	close(fd);
+	close(wake[0]);
+	wake[0] = -1;
+}
+
+static bool line_reader_init(struct line_reader *r, int fd, size_t bufsz, size_t max_bufsz)
+{
+	if (max_bufsz != 0 && bufsz > max_bufsz)
+		bufsz = max_bufsz;
+
+	*r = (struct line_reader){ .fd = fd, .bufsz = bufsz, .max_bufsz = max_bufsz };
+	r->buf = malloc(bufsz);
+	return r->buf != NULL;
+}
+
+// Returns the next line that has already been read, including its
+// newline (the last line of input may not have one), and points
+// *line at it. Returns 0 if more input is needed or, once eof is
+// set, at end of input.
+//
+// One byte past the end of each line is always addressable so that
+// callers can temporarily NUL-terminate a substring.
+static ssize_t next_buffered_line(struct line_reader *r, char **line)
+{
+	char *nl = memchr(r->buf + r->scan, '\n', r->tail - r->scan);
+	size_t start = r->head;
+	bool fragment = false;
+
+	if (nl != NULL) {
+		r->head = nl - r->buf + 1;
+	} else if (r->eof) {
+		r->head = r->tail;
+	} else if (r->max_bufsz != 0 && r->bufsz >= r->max_bufsz && r->tail - r->head + 1 >= r->bufsz) {
+		// At the size limit and still no newline.
+		r->head = r->tail;
+		fragment = true;
+	} else {
+		r->scan = r->tail;
+		return 0;
+	}
+
+	r->scan = r->head;
+	r->continuation = r->fragment;
+	r->fragment = fragment;
+	*line = r->buf + start;
+	return r->head - start;
+}
+
+// Reads more input, making room for it first. Call only once
+// next_buffered_line() has returned 0. Returns the number of bytes
+// read, 0 at end of input (and sets eof) or -1 on error with errno
+// set.
+static ssize_t fill_line_buffer(struct line_reader *r)
+{
+	if (r->head > 0) {
+		memmove(r->buf, r->buf + r->head, r->tail - r->head);
+		r->tail -= r->head;
+		r->scan -= r->head;
+		r->head = 0;
+	}
+
+	if (r->tail + 1 >= r->bufsz) {
+		size_t new_bufsz = r->bufsz * 2;
+		if (r->max_bufsz != 0 && new_bufsz > r->max_bufsz)
+			new_bufsz = r->max_bufsz;
+		if (new_bufsz <= r->bufsz) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		char *new_buf = realloc(r->buf, new_bufsz);
+		if (new_buf == NULL)
+			return -1;
+		r->buf = new_buf;
+		r->bufsz = new_bufsz;
+	}
+
+	ssize_t n = read(r->fd, r->buf + r->tail, r->bufsz - r->tail - 1);
+
+	if (n == 0)
+		r->eof = true;
+	else if (n > 0)
+		r->tail += n;
+
+	return n;
+}
+
+// Returns the length of the next line, reading as much input as it
+// takes, and points *line at it; see next_buffered_line(). Returns 0
+// at end of input and -1 on error with errno set. A read interrupted
+// by a signal is retried unless stop is set.
+static ssize_t read_line(struct line_reader *r, char **line, volatile sig_atomic_t *stop)
+{
+	for (;;) {
+		ssize_t n = next_buffered_line(r, line);
+
+		if (n > 0 || r->eof)
+			return n;
+
+		if (fill_line_buffer(r) < 0 && (errno != EINTR || *stop))
+			return -1;
+	}
+}
+
+// Compressed input. A gzip or zstd stream is recognised by its magic
+// number and decompressed by a thread into a pipe, which then stands
+// in for the original descriptor, so that decompression overlaps with
+// matching and stamping and everything downstream of the line reader
+// (poll(2), epoll(7)) works unchanged.
+#define DECOMPRESS_BUFSZ (128 * 1024)
+
+static const struct {
+	enum compress format;
+	const char *name;
+	unsigned char magic[4];
+	size_t len;
+} compressed_formats[] = {
+	{ COMPRESS_GZIP, "gzip", { 0x1f, 0x8b }, 2 },
+	{ COMPRESS_ZSTD, "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4 },
+};
+
+struct decompressor {
+	const char *name;
+	enum compress format;
+	int in;			// The compressed input.
+	int out;		// Write end of the pipe.
+	int stop[2];		// Closing stop[1] makes the thread stop.
+	pthread_t thread;
+	unsigned char *inbuf;
+	size_t inlen;		// Input already read when detecting.
+	unsigned char *outbuf;
+};
+
+// Set by a decompressor thread that found its input corrupt.
+static bool input_corrupt;
+
+// Returns the format whose magic number p starts with. If len is too
+// short to tell, sets *partial when p could still be the start of
+// one.
+static enum compress detect_compression(const unsigned char *p, size_t len, bool *partial)
+{
+	*partial = false;
+
+	for (size_t i = 0; i < NELEMENTS(compressed_formats); i++) {
+		size_t n = len < compressed_formats[i].len ? len : compressed_formats[i].len;
+		if (memcmp(p, compressed_formats[i].magic, n) != 0)
+			continue;
+		if (n == compressed_formats[i].len)
+			return compressed_formats[i].format;
+		*partial = true;
+	}
+
+	return COMPRESS_NONE;
+}
+
+#if defined(TS_ZLIB) || defined(TS_ZSTD)
+// Reads the next compressed input, or returns -1 once the reader
+// has gone away, which a live pipe may never tell by itself.
+static ssize_t decompress_read(struct decompressor *d)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = d->in, .events = POLLIN },
+		{ .fd = d->stop[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(pfd, NELEMENTS(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: %s: %s.\n", d->name, strerror(errno));
+			return -1;
+		}
+		if (pfd[1].revents)
+			return -1;
+
+		ssize_t n = read(d->in, d->inbuf, DECOMPRESS_BUFSZ);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+			if (n < 0)
+				fprintf(stderr, "Error: %s: %s.\n", d->name, strerror(errno));
+			return n;
+		}
+	}
+}
+
+static void decompress_corrupt(struct decompressor *d, const char *why)
+{
+	fprintf(stderr, "Error: %s: %s.\n", d->name, why);
+	input_corrupt = true;
+}
+#endif
+
+#ifdef TS_ZLIB
+// Decompresses every member of a gzip stream. Returns false if the
+// reader has gone away or on error.
+static bool decompress_gzip(struct decompressor *d)
+{
+	z_stream z = { 0 };
+	bool in_member = false;
+	bool more = false;	// Output left over from the last call.
+	bool ok = false;
+
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		decompress_corrupt(d, "inflateInit2 failed");
+		return false;
+	}
+
+	z.next_in = d->inbuf;
+	z.avail_in = d->inlen;
+
+	for (;;) {
+		if (z.avail_in == 0 && !more) {
+			ssize_t n = decompress_read(d);
+			if (n < 0)
+				break;
+			if (n == 0) {
+				if (in_member)
+					decompress_corrupt(d, "unexpected end of gzip data");
+				ok = !in_member;
+				break;
+			}
+			z.next_in = d->inbuf;
+			z.avail_in = n;
+		}
+
+		in_member = true;
+		z.next_out = d->outbuf;
+		z.avail_out = DECOMPRESS_BUFSZ;
+
+		int rc = inflate(&z, Z_NO_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			decompress_corrupt(d, z.msg != NULL ? z.msg : "corrupt gzip data");
+			break;
+		}
+		if (!write_all(d->out, d->outbuf, DECOMPRESS_BUFSZ - z.avail_out))
+			break;
+
+		more = z.avail_out == 0;
+		if (rc == Z_STREAM_END) {
+			// Concatenated members follow on as one stream.
+			inflateReset(&z);
+			in_member = false;
+		}
+	}
+
+	inflateEnd(&z);
+	return ok;
+}
+#endif
+
+#ifdef TS_ZSTD
+// Decompresses every frame of a zstd stream. Returns false if the
+// reader has gone away or on error.
+static bool decompress_zstd(struct decompressor *d)
+{
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer in = { d->inbuf, d->inlen, 0 };
+	size_t rc = 0;
+	bool more = false;
+	bool ok = false;
+
+	if (dctx == NULL) {
+		decompress_corrupt(d, "ZSTD_createDCtx failed");
+		return false;
+	}
+
+	for (;;) {
+		if (in.pos == in.size && !more) {
+			ssize_t n = decompress_read(d);
+			if (n < 0)
+				break;
+			if (n == 0) {
+				// Anything other than 0 is the middle of a frame.
+				if (rc != 0)
+					decompress_corrupt(d, "unexpected end of zstd data");
+				ok = rc == 0;
+				break;
+			}
+			in = (ZSTD_inBuffer){ d->inbuf, n, 0 };
+		}
+
+		ZSTD_outBuffer out = { d->outbuf, DECOMPRESS_BUFSZ, 0 };
+		rc = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(rc)) {
+			decompress_corrupt(d, ZSTD_getErrorName(rc));
+			break;
+		}
+		if (!write_all(d->out, d->outbuf, out.pos))
+			break;
+		more = out.pos == out.size;
+	}
+
+	ZSTD_freeDCtx(dctx);
+	return ok;
+}
+#endif
+
+static void *decompress_thread(void *arg)
+{
+	struct decompressor *d = arg;
+
+	switch (d->format) {
+#ifdef TS_ZLIB
+	case COMPRESS_GZIP:
+		decompress_gzip(d);
+		break;
+#endif
+#ifdef TS_ZSTD
+	case COMPRESS_ZSTD:
+		decompress_zstd(d);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	// The reader sees end of input.
+	close(d->out);
+	return NULL;
+}
+
+// Looks at the start of r's input and, if it is compressed, starts a
+// thread to decompress it; name is used in errors. Input read from a
+// pipe while looking stays in the line buffer, and no more is read
+// than it takes to tell, so a live stream is not held up.
+static void line_reader_decompress(struct line_reader *r, const char *name)
+{
+	enum compress format = COMPRESS_NONE;
+	unsigned char magic[4];
+	bool partial = false;
+	off_t off = lseek(r->fd, 0, SEEK_CUR);
+
+	if (off >= 0) {
+		ssize_t n = pread(r->fd, magic, sizeof(magic), off);
+		if (n > 0)
+			format = detect_compression(magic, n, &partial);
+	} else {
+		do {
+			ssize_t n = read(r->fd, r->buf + r->tail, r->bufsz - r->tail - 1);
+			if (n < 0)
+				return;		// Left for read_line() to report.
+			if (n == 0) {
+				r->eof = true;
+				return;
+			}
+			r->tail += n;
+			format = detect_compression((unsigned char *)r->buf, r->tail, &partial);
+		} while (format == COMPRESS_NONE && partial);
+	}
+
+	if (format == COMPRESS_NONE)
+		return;
+
+#ifndef TS_ZLIB
+	if (format == COMPRESS_GZIP) {
+		fprintf(stderr, "Error: %s: gzip input, but ts was built without zlib (make USE_ZLIB=1).\n", name);
+		exit(EXIT_FAILURE);
+	}
+#endif
+#ifndef TS_ZSTD
+	if (format == COMPRESS_ZSTD) {
+		fprintf(stderr, "Error: %s: zstd input, but ts was built without libzstd (make USE_ZSTD=1).\n", name);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	struct decompressor *d = calloc(1, sizeof(*d));
+	int fds[2];
+
+	if (d == NULL || (d->inbuf = malloc(DECOMPRESS_BUFSZ)) == NULL ||
+	    (d->outbuf = malloc(DECOMPRESS_BUFSZ)) == NULL) {
+		perror("decompression buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	d->name = name;
+	d->format = format;
+	d->in = r->fd;
+	d->inlen = r->tail;
+	memcpy(d->inbuf, r->buf, r->tail);
+	r->tail = 0;
+
+	int flags = fcntl(r->fd, F_GETFL);
+	if (pipe(fds) != 0 || fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0 || pipe(d->stop) != 0 ||
+	    fcntl(d->stop[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	    fcntl(d->stop[1], F_SETFD, FD_CLOEXEC) != 0 ||
+	    (flags != -1 && (flags & O_NONBLOCK) && fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0)) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	d->out = fds[1];
+	r->fd = fds[0];
+	r->decomp = d;
+
+	if ((errno = start_thread(&d->thread, decompress_thread, d)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Frees r's buffer and stops its decompressor, if it has one: r->fd
+// is then the original descriptor again, for the caller to close.
+static void line_reader_free(struct line_reader *r)
+{
+	struct decompressor *d = r->decomp;
+
+	if (d != NULL) {
+		// A thread still writing gets EPIPE and one waiting
+		// for input sees stop[0] hang up; either way it stops.
+		close(r->fd);
+		close(d->stop[1]);
+		pthread_join(d->thread, NULL);
+		close(d->stop[0]);
+		r->fd = d->in;
+		r->decomp = NULL;
+		free(d->inbuf);
+		free(d->outbuf);
+		free(d);
+	}
+
+	free(r->buf);
+	r->buf = NULL;
+}
+
+// Waits for input on several descriptors at once: epoll(7) on Linux
+// and poll(2) elsewhere. Descriptors are registered with a small
+// integer id, which is what poller_wait() reports back; hang-ups and
+// errors are reported as readable so that the following read(2)
+// sees them.
+#define POLLER_MAX 256
+
+struct poller {
+#ifdef __linux__
+	int epfd;
+#else
+	struct pollfd fds[POLLER_MAX];
+	int ids[POLLER_MAX];
+	size_t nfds;
+#endif
+};
+
+static bool poller_init(struct poller *p)
+{
+#ifdef __linux__
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return p->epfd != -1;
+#else
+	p->nfds = 0;
+	return true;
+#endif
+}
+
+static void poller_free(struct poller *p)
+{
+#ifdef __linux__
+	close(p->epfd);
+#else
+	p->nfds = 0;
+#endif
+}
+
+static bool poller_add(struct poller *p, int fd, int id)
+{
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+	return epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+	if (p->nfds == POLLER_MAX) {
+		errno = ENOSPC;
+		return false;
+	}
+	p->fds[p->nfds] = (struct pollfd){ .fd = fd, .events = POLLIN };
+	p->ids[p->nfds++] = id;
+	return true;
+#endif
+}
+
+static void poller_remove(struct poller *p, int fd)
+{
+#ifdef __linux__
+	epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	for (size_t i = 0; i < p->nfds; i++) {
+		if (p->fds[i].fd == fd) {
+			p->fds[i] = p->fds[--p->nfds];
+			p->ids[i] = p->ids[p->nfds];
+			break;
+		}
+	}
+#endif
+}
+
+// Stores the ids of up to max_ids ready descriptors in ids and
+// returns how many there are: 0 on timeout, -1 on error (including
+// EINTR). A negative timeout waits indefinitely.
+static int poller_wait(struct poller *p, int *ids, int max_ids, int timeout_ms)
+{
+#ifdef __linux__
+	struct epoll_event events[POLLER_MAX];
+
+	if (max_ids > POLLER_MAX)
+		max_ids = POLLER_MAX;
+
+	int n = epoll_wait(p->epfd, events, max_ids, timeout_ms);
+	for (int i = 0; i < n; i++)
+		ids[i] = events[i].data.u32;
+	return n;
+#else
+	int n = poll(p->fds, p->nfds, timeout_ms);
+	if (n <= 0)
+		return n;
+
+	n = 0;
+	for (size_t i = 0; i < p->nfds && n < max_ids; i++) {
+		if (p->fds[i].revents != 0)
+			ids[n++] = p->ids[i];
+	}
+	return n;
+#endif
+}
+
+// Synthetic log lines, for --generate and for the benchmark corpus
+// (see bench/corpus.c). There is one family per timestamps[] entry,
+// each mimicking its format, plus lines without timestamps, long JSON
+// lines and a mix of all of them. The output is a pure function of
+// the seed and the times fed in through sec and nsec.
+// Room needed in a line buffer beyond --line-length: the longest line
+// any family writes by default is a JSON line of about 4.5K.
+#define GEN_HEADROOM 8192
+
+struct gen_state {
+	uint64_t rng;
+	time_t sec;		// Time embedded in the next line.
+	long nsec;
+	bool advance;		// Move sec/nsec on by up to 50ms per line.
+	size_t len_min;		// Line length bounds, excluding the
+	size_t len_max;		// newline; 0 for each family's own.
+};
+
+typedef size_t (*gen_line_fn)(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz);
+
+struct gen_family {
+	const char *name;
+	const char *description;
+	const char *strftime_format;
+	// Printed straight after the strftime(3) output, which has no
+	// sub-second conversions; see gen_append_suffix().
+	enum { GEN_NO_SUFFIX, GEN_K8S_SUFFIX, GEN_KLOG_SUFFIX } suffix;
+	gen_line_fn fn;
+};
+
+static const char *const gen_words[] = {
+	"accepted", "backend", "cache", "connection", "controller", "deadline",
+	"dispatch", "endpoint", "error", "failed", "handler", "healthy",
+	"ingress", "lease", "listener", "manager", "node", "pod", "proxy",
+	"queue", "reconcile", "request", "response", "retry", "route",
+	"scheduled", "server", "session", "shard", "started", "stopped",
+	"syncing", "timeout", "upstream", "watch", "worker",
+};
+
+// splitmix64; small, fast and good enough for synthetic text.
+static uint64_t gen_rand(struct gen_state *st)
+{
+	uint64_t z = (st->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t gen_rand_range(struct gen_state *st, uint64_t lo, uint64_t hi)
+{
+	return lo + gen_rand(st) % (hi - lo + 1);
+}
+
+// Advances the clock by up to 50ms so that timestamps are
+// non-decreasing and several lines share each second.
+static void gen_advance_clock(struct gen_state *st)
+{
+	if (!st->advance)
+		return;
+
+	st->nsec += gen_rand_range(st, 0, 50 * 1000 * 1000);
+	while (st->nsec >= NANOSECONDS_PER_SECOND) {
+		st->nsec -= NANOSECONDS_PER_SECOND;
+		st->sec++;
+	}
+}
+
+// The length to fill a line to: from --line-length if given,
+// otherwise prefix plus a family-specific amount of text.
+static size_t gen_target_len(struct gen_state *st, size_t prefix, uint64_t lo, uint64_t hi)
+{
+	if (st->len_max == 0)
+		return prefix + gen_rand_range(st, lo, hi);
+	return gen_rand_range(st, st->len_min, st->len_max);
+}
+
+static size_t gen_append_words(struct gen_state *st, char *buf, size_t offset, size_t bufsz, size_t target_len)
+{
+	size_t start = offset;
+
+	while (offset < target_len && offset + 16 < bufsz) {
+		const char *w = gen_words[gen_rand(st) % NELEMENTS(gen_words)];
+		size_t n = strlen(w);
+		if (offset + n + 1 >= bufsz)
+			break;
+		if (offset != start)
+			buf[offset++] = ' ';
+		memcpy(buf + offset, w, n);
+		offset += n;
+	}
+
+	// An explicit length is met exactly, possibly mid-word.
+	if (st->len_max != 0 && offset > target_len)
+		offset = target_len > start ? target_len : start;
+
+	return offset;
+}
+
+static size_t gen_append_stamp(struct gen_state *st, char *buf, size_t bufsz, const char *format)
+{
+	struct tm tm;
+	gmtime_r(&st->sec, &tm);
+	return strftime(buf, bufsz, format, &tm);
+}
+
+static size_t gen_plain_line(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz)
+{
+	(void)f;
+	size_t n = gen_append_words(st, buf, 0, bufsz, gen_target_len(st, 0, 20, 160));
+	buf[n++] = '\n';
+	return n;
+}
+
+static size_t gen_append_suffix(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz)
+{
+	switch (f->suffix) {
+	case GEN_K8S_SUFFIX:
+		return snprintf(buf, bufsz, ".%09ldZ", st->nsec);
+	case GEN_KLOG_SUFFIX:
+		return snprintf(buf, bufsz, ".%06ld %7d main.go:%d]", st->nsec / 1000,
+				(int)gen_rand_range(st, 1, 99999), (int)gen_rand_range(st, 10, 999));
+	default:
+		return 0;
+	}
+}
+
+static size_t gen_stamped_line(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz)
+{
+	gen_advance_clock(st);
+
+	size_t n = gen_append_stamp(st, buf, bufsz, f->strftime_format);
+	n += gen_append_suffix(st, f, buf + n, bufsz - n);
+	buf[n++] = ' ';
+	n = gen_append_words(st, buf, n, bufsz, gen_target_len(st, n, 20, 160));
+	buf[n++] = '\n';
+	return n;
+}
+
+// With --line-length only the total length of the attributes is
+// aimed for, so JSON lines stay valid but are only roughly the
+// requested length.
+static size_t gen_json_line(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz)
+{
+	(void)f;
+	gen_advance_clock(st);
+
+	size_t len_max = st->len_max;
+	st->len_max = 0;
+
+	size_t n = (size_t)snprintf(buf, bufsz, "{\"time\":\"");
+	n += gen_append_stamp(st, buf + n, bufsz - n, "%Y-%m-%dT%H:%M:%S");
+	n += snprintf(buf + n, bufsz - n, ".%09ldZ\",\"level\":\"%s\",\"msg\":\"", st->nsec,
+		      (gen_rand(st) & 7) == 0 ? "error" : "info");
+	n = gen_append_words(st, buf, n, bufsz, n + gen_rand_range(st, 40, 120));
+
+	st->len_max = len_max;
+
+	// A long tail of attributes, as emitted by structured loggers
+	// that dump whole request contexts.
+	size_t target = gen_target_len(st, n, 512, 4096);
+	if (st->len_max != 0)
+		target = target > n + 2 ? target - 2 : n;	// For the closing "}}".
+	n += snprintf(buf + n, bufsz - n, "\",\"attrs\":{");
+	for (int field = 0; n < target && n + 96 < bufsz; field++) {
+		n += snprintf(buf + n, bufsz - n, "%s\"%s_%d\":\"%016llx\"",
+			      field ? "," : "",
+			      gen_words[gen_rand(st) % NELEMENTS(gen_words)],
+			      field,
+			      (unsigned long long)gen_rand(st));
+	}
+	n += snprintf(buf + n, bufsz - n, "}}\n");
+	return n;
+}
+
+static size_t gen_mixed_line(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz);
+
+// One family per timestamps[] entry, in the same order, followed by
+// the synthetic families. Keep the two lists in step.
+static const struct gen_family gen_families[] = {
+	{ "k8s", "Kubernetes pod log entry with timestamp", "%Y-%m-%dT%H:%M:%S", GEN_K8S_SUFFIX, gen_stamped_line },
+	{ "klog", "Kubernetes client-go log format with microseconds", "I%m%d %H:%M:%S", GEN_KLOG_SUFFIX, gen_stamped_line },
+	{ "rfc822", "16 Jun 94 07:29:35 with timezone", "%d %b %y %H:%M:%S +0000", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "dmy-tz", "21 dec/93 17:05:30 +0000", "%d %b/%y %H:%M:%S +0000", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "dm-tz", "21 dec 17:05:30 +0000", "%d %b %H:%M:%S +0000", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "dmy", "21 dec/93 17:05 without seconds and timezone", "%d %b/%y %H:%M", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "dm", "21 dec 17:05 without seconds and timezone", "%d %b %H:%M", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "iso8601", "ISO-8601 format", "%Y-%m-%dT%H:%M:%S", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "lastlog", "Lastlog format", "%a %b %d %H:%M", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "syslog", "Syslog format with day", "%b %e %H:%M:%S", GEN_NO_SUFFIX, gen_stamped_line },
+	{ "plain", "Lines without timestamps", NULL, GEN_NO_SUFFIX, gen_plain_line },
+	{ "json", "Long JSON lines with embedded RFC 3339 timestamps", NULL, GEN_NO_SUFFIX, gen_json_line },
+	{ "mixed", "A mix of all of the above", NULL, GEN_NO_SUFFIX, gen_mixed_line },
+};
+
+static const struct gen_family *find_gen_family(const char *name)
+{
+	for (size_t i = 0; i < NELEMENTS(gen_families); i++) {
+		if (strcmp(gen_families[i].name, name) == 0)
+			return &gen_families[i];
+	}
+	return NULL;
+}
+
+static size_t gen_mixed_line(struct gen_state *st, const struct gen_family *f, char *buf, size_t bufsz)
+{
+	(void)f;
+
+	// Everything except "mixed" itself; JSON lines are large so
+	// pick them less often to keep the line count representative.
+	size_t i = gen_rand(st) % (NELEMENTS(gen_families) - 1);
+	if (gen_families[i].fn == gen_json_line && (gen_rand(st) & 3) != 0)
+		return gen_plain_line(st, &gen_families[i], buf, bufsz);
+	return gen_families[i].fn(st, &gen_families[i], buf, bufsz);
+}
+
+static void must_init_timestamp_patterns(void)
+{
+	for (size_t i = 0; i < NELEMENTS(timestamps); i++) {
+		PCRE2_SIZE offset;
+		PCRE2_SPTR pattern = (PCRE2_SPTR)timestamps[i].re;
+		int rc;
+		uint32_t options = PCRE2_UTF | PCRE2_UCP;
+
+		timestamps[i].pcre = pcre2_compile(
+			pattern,                // the pattern
+			PCRE2_ZERO_TERMINATED,  // indicates the pattern is zero-terminated
+			options,		// options
+			&rc,			// for error number
+			&offset,		// for error offset
+			NULL                    // use default compile context
+			);
+
+		if (timestamps[i].pcre == NULL) {
+			PCRE2_UCHAR buf[256];
+			pcre2_get_error_message(rc, buf, sizeof(buf));
+			fprintf(stderr, "PCRE2 compilation error for pattern#%zd: '%s', error='%s', offset=%ld.\n", i, timestamps[i].re, buf, offset);
+			exit(EXIT_FAILURE);
+		}
+
+		timestamps[i].match_data = pcre2_match_data_create_from_pattern(timestamps[i].pcre, NULL);
+		if (timestamps[i].match_data == NULL) {
+			fprintf(stderr, "Failed to create match data for pattern %zu\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Compiles a pattern given on the command line, with the JIT if
+// PCRE2 has one. It matches bytes, so any input is fine.
+static pcre2_code *must_compile_user_regex(const char *name, const char *pattern)
+{
+	PCRE2_SIZE offset;
+	int rc;
+	pcre2_code *re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, 0, &rc, &offset, NULL);
+
+	if (re == NULL) {
+		PCRE2_UCHAR buf[256];
+		pcre2_get_error_message(rc, buf, sizeof(buf));
+		fprintf(stderr, "Error: --%s '%s': %s at offset %zu.\n", name, pattern, buf, (size_t)offset);
+		exit(EXIT_FAILURE);
+	}
+
+	// Without the JIT, pcre2_match() interprets the pattern.
+	pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+	return re;
+}
+
+// Compiles --match and --exclude.
+static void must_init_filters(const struct ts_opt *opt, struct ts_fmt *fmt)
+{
+	if (opt->nmatch == 0 && opt->nexclude == 0)
+		return;
+
+	fmt->match = calloc(opt->nmatch + 1, sizeof(*fmt->match));
+	fmt->exclude = calloc(opt->nexclude + 1, sizeof(*fmt->exclude));
+	fmt->filter_data = pcre2_match_data_create(1, NULL);
+	if (fmt->match == NULL || fmt->exclude == NULL || fmt->filter_data == NULL) {
+		perror("filters");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < opt->nmatch; i++)
+		fmt->match[i] = must_compile_user_regex("match", opt->match[i]);
+	for (size_t i = 0; i < opt->nexclude; i++)
+		fmt->exclude[i] = must_compile_user_regex("exclude", opt->exclude[i]);
+}
+
+static void free_filters(const struct ts_opt *opt, struct ts_fmt *fmt)
+{
+	for (size_t i = 0; fmt->match != NULL && i < opt->nmatch; i++)
+		pcre2_code_free(fmt->match[i]);
+	for (size_t i = 0; fmt->exclude != NULL && i < opt->nexclude; i++)
+		pcre2_code_free(fmt->exclude[i]);
+	pcre2_match_data_free(fmt->filter_data);
+	free(fmt->match);
+	free(fmt->exclude);
+}
+
+// Whether a line passes --match and --exclude. The patterns see the
+// line without its newline.
+static bool filter_line(const struct ts_fmt *fmt, const char *line, size_t len)
+{
+	bool keep = fmt->match[0] == NULL;
+
+	if (len > 0 && line[len - 1] == '\n')
+		len--;
+
+	for (pcre2_code **re = fmt->match; *re != NULL && !keep; re++)
+		keep = pcre2_match(*re, (PCRE2_SPTR)line, len, 0, 0, fmt->filter_data, NULL) >= 0;
+
+	for (pcre2_code **re = fmt->exclude; *re != NULL && keep; re++)
+		keep = pcre2_match(*re, (PCRE2_SPTR)line, len, 0, 0, fmt->filter_data, NULL) < 0;
+
+	return keep;
+}
+
+static bool init_clocks(const struct ts_opt *const ts, long *last_seconds, long *last_nanoseconds, long *monodelta)
+{
+	struct timespec now;
+
+	if (read_clock(CLOCK_REALTIME, &now, false) != 0) {
+		return false;
+	}
+
+	*last_seconds = now.tv_sec;
+	*last_nanoseconds = ts->hires_timestamping ? now.tv_nsec : 0;
+	*monodelta = 0;
+
+	if (ts->flag_mono) {
+		struct timespec real_time;
+		if (read_clock(CLOCK_MONOTONIC, &real_time, false) != 0) {
+			return false;
+		}
 
 		if (now.tv_sec >= real_time.tv_sec) {
 			*monodelta = now.tv_sec - real_time.tv_sec;
 			*last_seconds = real_time.tv_sec + *monodelta;
 			*last_nanoseconds = real_time.tv_nsec;
 		} else {
-			fprintf(stderr, "fatal error: real time is less than monotonic time!\n");
+			fprintf(stderr, "fatal error: real time is less than monotonic time!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: ts [-r] [-i | -s] [-m] [-p precision] [format]\n"
+		"          [--max-line-bytes N [--long-lines stream|truncate]]\n"
+		"          [--fake-clock START[+STEP] | --fake-clock FILE]\n"
+		"       ts --replay[=SPEED] [--fake-clock ...]\n"
+		"       ts --generate[=FAMILY] [--rate N] [--profile constant|poisson|burst[:N]]\n"
+		"          [--line-length MIN[-MAX]] [--count N] [--duration SECONDS] [--seed N]\n"
+		"          [-r] [-i | -s] [-m] [format]\n"
+		"       ts [options] [format] -- command [args...]\n"
+		"          [--stream-tags[=OUT,ERR]] [--pty [--keep-cr]]\n"
+		"       ts [options] [format] --input [LABEL=]PATH|-|fd:N ...\n"
+		"          [--split-output DIR]\n"
+		"       ts --merge --input [LABEL=]PATH|-|fd:N ...\n"
+		"       ts --reorder SECONDS [--reorder-by embedded|arrival] [--reorder-buffer BYTES]\n"
+		"       ts [--from TIME] [--to TIME] < FILE\n"
+		"       ts --archive FILE\n"
+		"       ts --query FILE [--from TIME] [--to TIME] [--count-per SECONDS] [format]\n"
+		"       ts --binary[=source,seq] [options]\n"
+		"       ts --decode [format]\n"
+		"       ts --json[=FIELD=NAME,...] [options] [format]\n"
+		"       ts --output FILE [--compress gzip|zstd [--compress-level N]\n"
+		"          [--frame-size BYTES] [--compress-threads N]]\n"
+		"          [--rotate-size BYTES] [--rotate-interval SECONDS] [--rotate-keep N]\n"
+		"          [--preallocate BYTES] [--mmap] [options] [format]\n"
+		"       ts --shard TEMPLATE [--shard-files N] [options] [format]\n"
+		"       ts --ring BYTES --ring-dump TEMPLATE [--trigger REGEX [--after-trigger N]]\n"
+		"          [options] [format]\n"
+		"       ts --lossy BYTES [options] [format]\n"
+		"       ts --match REGEX ... --exclude REGEX ... [options] [format]\n");
+	exit(EXIT_FAILURE);
+}
+
+// Parses a byte count with an optional K, M or G (binary) suffix.
+static unsigned long long parse_size_option(const char *name, const char *arg)
+{
+	char *endptr;
+
+	errno = 0;
+	unsigned long long value = strtoull(arg, &endptr, 10);
+	int shift = 0;
+
+	switch (*endptr) {
+	case 'k': case 'K': shift = 10; endptr++; break;
+	case 'm': case 'M': shift = 20; endptr++; break;
+	case 'g': case 'G': shift = 30; endptr++; break;
+	}
+
+	if (errno != 0 || endptr == arg || *endptr != '\0' || *arg == '-' ||
+	    value > (ULLONG_MAX >> shift)) {
+		fprintf(stderr, "Error: --%s %s: invalid size.\n", name, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return value << shift;
+}
+
+enum {
+	OPT_MAX_LINE_BYTES = 256,
+	OPT_LONG_LINES,
+	OPT_FAKE_CLOCK,
+	OPT_REPLAY,
+	OPT_GENERATE,
+	OPT_RATE,
+	OPT_PROFILE,
+	OPT_LINE_LENGTH,
+	OPT_COUNT,
+	OPT_DURATION,
+	OPT_SEED,
+	OPT_STREAM_TAGS,
+	OPT_PTY,
+	OPT_KEEP_CR,
+	OPT_INPUT,
+	OPT_SPLIT_OUTPUT,
+	OPT_MERGE,
+	OPT_REORDER,
+	OPT_REORDER_BY,
+	OPT_REORDER_BUFFER,
+	OPT_FROM,
+	OPT_TO,
+	OPT_ARCHIVE,
+	OPT_QUERY,
+	OPT_COUNT_PER,
+	OPT_BINARY,
+	OPT_DECODE,
+	OPT_JSON,
+	OPT_OUTPUT,
+	OPT_COMPRESS,
+	OPT_COMPRESS_LEVEL,
+	OPT_FRAME_SIZE,
+	OPT_COMPRESS_THREADS,
+	OPT_ROTATE_SIZE,
+	OPT_ROTATE_INTERVAL,
+	OPT_ROTATE_KEEP,
+	OPT_PREALLOCATE,
+	OPT_MMAP,
+	OPT_SHARD,
+	OPT_SHARD_FILES,
+	OPT_RING,
+	OPT_RING_DUMP,
+	OPT_TRIGGER,
+	OPT_AFTER_TRIGGER,
+	OPT_LOSSY,
+	OPT_MATCH,
+	OPT_EXCLUDE,
+};
+
+static const struct option long_options[] = {
+	{ "max-line-bytes", required_argument, NULL, OPT_MAX_LINE_BYTES },
+	{ "long-lines", required_argument, NULL, OPT_LONG_LINES },
+	{ "fake-clock", required_argument, NULL, OPT_FAKE_CLOCK },
+	{ "replay", optional_argument, NULL, OPT_REPLAY },
+	{ "generate", optional_argument, NULL, OPT_GENERATE },
+	{ "rate", required_argument, NULL, OPT_RATE },
+	{ "profile", required_argument, NULL, OPT_PROFILE },
+	{ "line-length", required_argument, NULL, OPT_LINE_LENGTH },
+	{ "count", required_argument, NULL, OPT_COUNT },
+	{ "duration", required_argument, NULL, OPT_DURATION },
+	{ "seed", required_argument, NULL, OPT_SEED },
+	{ "stream-tags", optional_argument, NULL, OPT_STREAM_TAGS },
+	{ "pty", no_argument, NULL, OPT_PTY },
+	{ "keep-cr", no_argument, NULL, OPT_KEEP_CR },
+	{ "input", required_argument, NULL, OPT_INPUT },
+	{ "split-output", required_argument, NULL, OPT_SPLIT_OUTPUT },
+	{ "merge", no_argument, NULL, OPT_MERGE },
+	{ "reorder", required_argument, NULL, OPT_REORDER },
+	{ "reorder-by", required_argument, NULL, OPT_REORDER_BY },
+	{ "reorder-buffer", required_argument, NULL, OPT_REORDER_BUFFER },
+	{ "from", required_argument, NULL, OPT_FROM },
+	{ "to", required_argument, NULL, OPT_TO },
+	{ "archive", required_argument, NULL, OPT_ARCHIVE },
+	{ "query", required_argument, NULL, OPT_QUERY },
+	{ "count-per", required_argument, NULL, OPT_COUNT_PER },
+	{ "binary", optional_argument, NULL, OPT_BINARY },
+	{ "decode", no_argument, NULL, OPT_DECODE },
+	{ "json", optional_argument, NULL, OPT_JSON },
+	{ "output", required_argument, NULL, OPT_OUTPUT },
+	{ "compress", required_argument, NULL, OPT_COMPRESS },
+	{ "compress-level", required_argument, NULL, OPT_COMPRESS_LEVEL },
+	{ "frame-size", required_argument, NULL, OPT_FRAME_SIZE },
+	{ "compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS },
+	{ "rotate-size", required_argument, NULL, OPT_ROTATE_SIZE },
+	{ "rotate-interval", required_argument, NULL, OPT_ROTATE_INTERVAL },
+	{ "rotate-keep", required_argument, NULL, OPT_ROTATE_KEEP },
+	{ "preallocate", required_argument, NULL, OPT_PREALLOCATE },
+	{ "mmap", no_argument, NULL, OPT_MMAP },
+	{ "shard", required_argument, NULL, OPT_SHARD },
+	{ "shard-files", required_argument, NULL, OPT_SHARD_FILES },
+	{ "ring", required_argument, NULL, OPT_RING },
+	{ "ring-dump", required_argument, NULL, OPT_RING_DUMP },
+	{ "trigger", required_argument, NULL, OPT_TRIGGER },
+	{ "after-trigger", required_argument, NULL, OPT_AFTER_TRIGGER },
+	{ "lossy", required_argument, NULL, OPT_LOSSY },
+	{ "match", required_argument, NULL, OPT_MATCH },
+	{ "exclude", required_argument, NULL, OPT_EXCLUDE },
+	{ NULL, 0, NULL, 0 },
+};
+
+// Parses a time for --from or --to: @SECONDS since the epoch, or a
+// timestamp in any of the formats that ts recognises in its input.
+static int64_t parse_time_option(const char *name, const char *arg)
+{
+	char buf[MAX_TIME_BUFSZ];
+	size_t len = strlen(arg);
+	struct timespec now;
+	struct tm parsed_tm;
+	struct timespec parsed;
+	size_t match_end;
+	int64_t ns;
+
+	if (arg[0] == '@') {
+		const char *end = parse_seconds(arg + 1, &ns);
+		if (end != NULL && *end == '\0')
+			return ns;
+	} else if (len < sizeof(buf) && read_clock(CLOCK_REALTIME, &now, false) == 0) {
+		memcpy(buf, arg, len + 1);
+		if (parse_timestamp(buf, len, now.tv_sec, &parsed_tm, &parsed, &match_end))
+			return timespec_to_ns(&parsed);
+	}
+
+	fprintf(stderr, "Error: --%s %s: expected @SECONDS or a timestamp ts recognises.\n", name, arg);
+	exit(EXIT_FAILURE);
+}
+
+static void usage_families(void)
+{
+	fprintf(stderr, "Families:\n");
+	for (size_t i = 0; i < NELEMENTS(gen_families); i++)
+		fprintf(stderr, "  %-8s %s\n", gen_families[i].name, gen_families[i].description);
+	exit(EXIT_FAILURE);
+}
+
+static struct ts_opt parse_options(int argc, char *argv[])
+{
+	struct ts_opt option = { 0 };
+	const char *gen_option = NULL;
+	const char *reorder_option = NULL;
+	const char *compress_option = NULL;
+	const char *output_option = NULL;
+	bool shard_files_option = false;
+	const char *ring_option = NULL;
+	char *sep;
+
+	int opt;
+	char *value_endptr;
+	long value;
+
+	option.flag_precision = 2; /* default */
+	option.gen.rate = 1000;
+	option.gen.burst = 100;
+	option.gen.seed = 1;
+	option.reorder_buffer = 16 << 20;
+	option.range_from = INT64_MIN;
+	option.range_to = INT64_MAX;
+	memcpy(option.json_names, json_fields, sizeof(json_fields));
+	option.compress_level = INT_MIN;
+	option.frame_size = 1 << 20;
+	option.rotate_keep = 5;
+	option.shard_files = 2;
+
+	// Everything after "--" is a command to run and stamp the
+	// output of; see run_command().
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			option.command = &argv[i + 1];
+			argv[i] = NULL;
+			argc = i;
+			break;
+		}
+	}
+
+	while ((opt = getopt_long(argc, argv, "imrsp:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			option.flag_inc = true;
+			break;
+		case 'm':
+			option.flag_mono = true;
+			break;
+		case 'r':
+			option.flag_rel = true;
+			break;
+		case 's':
+			option.flag_sincestart = true;
+			break;
+		case 'p':
+			value = strtol(optarg, &value_endptr, 10);
+			if ((errno == ERANGE && (value == LONG_MAX || value == LONG_MIN)) || (errno != 0 && value == 0)) {
+				fprintf(stderr, "Error: -p %ld: %s.\n", value, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if (value_endptr == optarg || *value_endptr != '\0' ||
+			    value < 1 || value >= TIME_UNIT_COUNT) {
+				fprintf(stderr, "Error: -p %ld is out of range. Valid values are between 1 and %d inclusive.\n", value, TIME_UNIT_COUNT-1);
+				exit(EXIT_FAILURE);
+			}
+			option.flag_precision = value;
+			break;
+		case OPT_MAX_LINE_BYTES:
+			option.max_line_bytes = parse_size_option("max-line-bytes", optarg);
+			if (option.max_line_bytes == 0 || option.max_line_bytes >= SIZE_MAX) {
+				fprintf(stderr, "Error: --max-line-bytes %s is out of range.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_LONG_LINES:
+			if (strcmp(optarg, "stream") == 0) {
+				option.truncate_long_lines = false;
+			} else if (strcmp(optarg, "truncate") == 0) {
+				option.truncate_long_lines = true;
+			} else {
+				fprintf(stderr, "Error: --long-lines %s: expected 'stream' or 'truncate'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FAKE_CLOCK:
+			init_fake_clock(optarg);
+			break;
+		case OPT_REPLAY:
+			option.replay = true;
+			option.replay_speed = 1;
+			if (optarg != NULL) {
+				option.replay_speed = strtod(optarg, &value_endptr);
+				if (value_endptr == optarg || *value_endptr != '\0' ||
+				    !(option.replay_speed > 0) || option.replay_speed > 1e9) {
+					fprintf(stderr, "Error: --replay=%s: expected a speed greater than 0.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case OPT_GENERATE:
+			option.gen.family = find_gen_family(optarg != NULL ? optarg : "mixed");
+			if (option.gen.family == NULL) {
+				fprintf(stderr, "Error: --generate=%s: unknown family.\n", optarg);
+				usage_families();
+			}
+			break;
+		case OPT_RATE:
+			gen_option = "--rate";
+			option.gen.rate = strtod(optarg, &value_endptr);
+			if (value_endptr == optarg || *value_endptr != '\0' ||
+			    !(option.gen.rate >= 0) || option.gen.rate > 1e9) {
+				fprintf(stderr, "Error: --rate %s: expected lines per second.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_PROFILE:
+			gen_option = "--profile";
+			if (strcmp(optarg, "constant") == 0) {
+				option.gen.profile = GEN_CONSTANT;
+			} else if (strcmp(optarg, "poisson") == 0) {
+				option.gen.profile = GEN_POISSON;
+			} else if (strncmp(optarg, "burst", 5) == 0 && (optarg[5] == '\0' || optarg[5] == ':')) {
+				option.gen.profile = GEN_BURST;
+				if (optarg[5] == ':')
+					option.gen.burst = parse_size_option("profile burst:", optarg + 6);
+				if (option.gen.burst == 0) {
+					fprintf(stderr, "Error: --profile %s: the burst size must be at least 1.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				fprintf(stderr, "Error: --profile %s: expected 'constant', 'poisson' or 'burst[:N]'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_LINE_LENGTH:
+			gen_option = "--line-length";
+			if ((sep = strchr(optarg, '-')) != NULL)
+				*sep = '\0';
+			option.gen.len_min = parse_size_option("line-length", optarg);
+			option.gen.len_max = sep != NULL ? parse_size_option("line-length", sep + 1) : option.gen.len_min;
+			if (sep != NULL)
+				*sep = '-';
+			if (option.gen.len_min == 0 || option.gen.len_min > option.gen.len_max ||
+			    option.gen.len_max > (1 << 30)) {
+				fprintf(stderr, "Error: --line-length %s: expected MIN[-MAX] between 1 and 1G.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_COUNT:
+			gen_option = "--count";
+			option.gen.count = parse_size_option("count", optarg);
+			break;
+		case OPT_DURATION:
+			gen_option = "--duration";
+			sep = (char *)parse_seconds(optarg, &option.gen.duration);
+			if (sep == NULL || *sep != '\0') {
+				fprintf(stderr, "Error: --duration %s: expected seconds.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SEED:
+			gen_option = "--seed";
+			option.gen.seed = parse_size_option("seed", optarg);
+			break;
+		case OPT_STREAM_TAGS:
+			option.stream_tags[0] = "stdout";
+			option.stream_tags[1] = "stderr";
+			if (optarg != NULL) {
+				if ((sep = strchr(optarg, ',')) == NULL) {
+					fprintf(stderr, "Error: --stream-tags=%s: expected OUT,ERR.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				*sep = '\0';
+				option.stream_tags[0] = optarg;
+				option.stream_tags[1] = sep + 1;
+			}
+			break;
+		case OPT_PTY:
+			option.pty = true;
+			break;
+		case OPT_KEEP_CR:
+			option.keep_cr = true;
+			break;
+		case OPT_INPUT:
+			if (option.ninputs == POLLER_MAX) {
+				fprintf(stderr, "Error: --input: at most %d inputs are supported.\n", POLLER_MAX);
+				exit(EXIT_FAILURE);
+			}
+			if (option.inputs == NULL && (option.inputs = calloc(argc, sizeof(*option.inputs))) == NULL) {
+				perror("calloc");
+				exit(EXIT_FAILURE);
+			}
+			option.inputs[option.ninputs++] = optarg;
+			break;
+		case OPT_SPLIT_OUTPUT:
+			option.split_output = optarg;
+			break;
+		case OPT_MERGE:
+			option.merge = true;
+			break;
+		case OPT_REORDER:
+			option.reorder = true;
+			sep = (char *)parse_seconds(optarg, &option.reorder_window);
+			if (sep == NULL || *sep != '\0') {
+				fprintf(stderr, "Error: --reorder %s: expected seconds.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_REORDER_BY:
+			reorder_option = "--reorder-by";
+			if (strcmp(optarg, "embedded") == 0) {
+				option.reorder_by_arrival = false;
+			} else if (strcmp(optarg, "arrival") == 0) {
+				option.reorder_by_arrival = true;
+			} else {
+				fprintf(stderr, "Error: --reorder-by %s: expected 'embedded' or 'arrival'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_REORDER_BUFFER:
+			reorder_option = "--reorder-buffer";
+			option.reorder_buffer = parse_size_option("reorder-buffer", optarg);
+			if (option.reorder_buffer == 0 || option.reorder_buffer >= SIZE_MAX / 2) {
+				fprintf(stderr, "Error: --reorder-buffer %s: out of range.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FROM:
+			option.range = true;
+			option.range_from = parse_time_option("from", optarg);
+			break;
+		case OPT_TO:
+			option.range = true;
+			option.range_to = parse_time_option("to", optarg);
+			break;
+		case OPT_ARCHIVE:
+			option.archive = optarg;
+			break;
+		case OPT_QUERY:
+			option.query = optarg;
+			break;
+		case OPT_BINARY:
+			option.binary = BINARY_ON;
+			for (char *field = optarg != NULL ? strtok(optarg, ",") : NULL; field != NULL; field = strtok(NULL, ",")) {
+				if (strcmp(field, "source") == 0) {
+					option.binary |= BINARY_SOURCE;
+				} else if (strcmp(field, "seq") == 0) {
+					option.binary |= BINARY_SEQ;
+				} else {
+					fprintf(stderr, "Error: --binary: unknown field '%s'; expected 'source' or 'seq'.\n", field);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case OPT_DECODE:
+			option.decode = true;
+			break;
+		case OPT_JSON:
+			option.json = true;
+			for (char *field = optarg != NULL ? strtok(optarg, ",") : NULL; field != NULL; field = strtok(NULL, ",")) {
+				size_t i;
+				if ((sep = strchr(field, '=')) != NULL)
+					*sep = '\0';
+				for (i = 0; i < JSON_FIELD_COUNT && strcmp(field, json_fields[i]) != 0; i++)
+					;
+				if (i == JSON_FIELD_COUNT || sep == NULL) {
+					fprintf(stderr, "Error: --json: expected FIELD=NAME, where FIELD is one of ts, ts_ns, parsed_ns, seq, source or line.\n");
+					exit(EXIT_FAILURE);
+				}
+				for (const char *c = sep + 1; *c != '\0'; c++) {
+					if (!json_plain(*c)) {
+						fprintf(stderr, "Error: --json: field name '%s' must be printable ASCII without quotes or backslashes.\n", sep + 1);
+						exit(EXIT_FAILURE);
+					}
+				}
+				option.json_names[i] = sep + 1;
+			}
+			break;
+		case OPT_COUNT_PER:
+			sep = (char *)parse_seconds(optarg, &option.count_per);
+			if (sep == NULL || *sep != '\0' || option.count_per == 0) {
+				fprintf(stderr, "Error: --count-per %s: expected seconds greater than 0.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_OUTPUT:
+			option.output = optarg;
+			break;
+		case OPT_COMPRESS:
+			if (strcmp(optarg, "gzip") == 0) {
+				option.compress = COMPRESS_GZIP;
+			} else if (strcmp(optarg, "zstd") == 0) {
+				option.compress = COMPRESS_ZSTD;
+			} else {
+				fprintf(stderr, "Error: --compress %s: expected 'gzip' or 'zstd'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_COMPRESS_LEVEL:
+			compress_option = "--compress-level";
+			errno = 0;
+			value = strtol(optarg, &value_endptr, 10);
+			if (errno != 0 || value_endptr == optarg || *value_endptr != '\0' || value < -1000 || value > 1000) {
+				fprintf(stderr, "Error: --compress-level %s: expected a level.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			option.compress_level = value;
+			break;
+		case OPT_FRAME_SIZE:
+			compress_option = "--frame-size";
+			option.frame_size = parse_size_option("frame-size", optarg);
+			if (option.frame_size == 0 || option.frame_size >= SIZE_MAX / 2) {
+				fprintf(stderr, "Error: --frame-size %s: out of range.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_COMPRESS_THREADS:
+			compress_option = "--compress-threads";
+			option.compress_threads = parse_size_option("compress-threads", optarg);
+			if (option.compress_threads > 256) {
+				fprintf(stderr, "Error: --compress-threads %s: at most 256 threads are supported.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_ROTATE_SIZE:
+			output_option = "--rotate-size";
+			option.rotate_size = parse_size_option("rotate-size", optarg);
+			if (option.rotate_size == 0 || option.rotate_size > INT64_MAX / 2) {
+				fprintf(stderr, "Error: --rotate-size %s: out of range.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_ROTATE_INTERVAL:
+			output_option = "--rotate-interval";
+			sep = (char *)parse_seconds(optarg, &option.rotate_interval);
+			if (sep == NULL || *sep != '\0' || option.rotate_interval < NANOSECONDS_PER_SECOND) {
+				fprintf(stderr, "Error: --rotate-interval %s: expected at least 1 second.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_ROTATE_KEEP:
+			output_option = "--rotate-keep";
+			if (parse_size_option("rotate-keep", optarg) > 1000) {
+				fprintf(stderr, "Error: --rotate-keep %s: at most 1000 files can be kept.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			option.rotate_keep = parse_size_option("rotate-keep", optarg);
+			break;
+		case OPT_PREALLOCATE:
+			output_option = "--preallocate";
+			option.preallocate = parse_size_option("preallocate", optarg);
+			if (option.preallocate > INT64_MAX / 2) {
+				fprintf(stderr, "Error: --preallocate %s: out of range.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_MMAP:
+			output_option = "--mmap";
+			option.mmap = true;
+			break;
+		case OPT_SHARD:
+			if (*optarg == '\0') {
+				fprintf(stderr, "Error: --shard requires a template.\n");
+				exit(EXIT_FAILURE);
+			}
+			option.shard = optarg;
+			break;
+		case OPT_SHARD_FILES:
+			shard_files_option = true;
+			if (parse_size_option("shard-files", optarg) - 1 >= 256) {
+				fprintf(stderr, "Error: --shard-files %s: expected 1 to 256.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			option.shard_files = parse_size_option("shard-files", optarg);
+			break;
+		case OPT_RING:
+			option.ring = parse_size_option("ring", optarg);
+			if (option.ring == 0) {
+				fprintf(stderr, "Error: --ring %s: expected a size.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_RING_DUMP:
+			ring_option = "--ring-dump";
+			option.ring_dump = optarg;
+			break;
+		case OPT_TRIGGER:
+			ring_option = "--trigger";
+			option.ring_trigger = optarg;
+			break;
+		case OPT_AFTER_TRIGGER:
+			ring_option = "--after-trigger";
+			option.ring_after = parse_size_option("after-trigger", optarg);
+			break;
+		case OPT_MATCH:
+			if (option.match == NULL && (option.match = calloc(argc, sizeof(*option.match))) == NULL) {
+				perror("calloc");
+				exit(EXIT_FAILURE);
+			}
+			option.match[option.nmatch++] = optarg;
+			break;
+		case OPT_EXCLUDE:
+			if (option.exclude == NULL && (option.exclude = calloc(argc, sizeof(*option.exclude))) == NULL) {
+				perror("calloc");
+				exit(EXIT_FAILURE);
+			}
+			option.exclude[option.nexclude++] = optarg;
+			break;
+		case OPT_LOSSY:
+			option.lossy = parse_size_option("lossy", optarg);
+			if (option.lossy < 4096) {
+				fprintf(stderr, "Error: --lossy %s: expected at least 4K.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (option.flag_inc && option.flag_sincestart) {
+		fprintf(stderr, "Options '-i' and '-s' cannot be used together.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.replay && (option.flag_inc || option.flag_sincestart || option.flag_rel ||
+			      option.flag_mono || optind < argc)) {
+		fprintf(stderr, "Option '--replay' cannot be used with '-i', '-s', '-r', '-m' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.replay && option.gen.family != NULL) {
+		fprintf(stderr, "Options '--replay' and '--generate' cannot be used together.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.command != NULL && option.command[0] == NULL) {
+		fprintf(stderr, "Error: no command after '--'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.command != NULL && (option.replay || option.gen.family != NULL)) {
+		fprintf(stderr, "A command cannot be used with '--replay' or '--generate'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((option.stream_tags[0] != NULL || option.pty) && option.command == NULL) {
+		fprintf(stderr, "Options '--stream-tags' and '--pty' require a command after '--'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.ninputs > 0 && (option.command != NULL || option.replay || option.gen.family != NULL)) {
+		fprintf(stderr, "Option '--input' cannot be used with a command, '--replay' or '--generate'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.split_output != NULL && option.ninputs == 0) {
+		fprintf(stderr, "Option '--split-output' requires '--input'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.merge && (option.ninputs == 0 || option.split_output != NULL)) {
+		fprintf(stderr, "Option '--merge' requires '--input' and cannot be used with '--split-output'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.merge && (option.flag_inc || option.flag_sincestart || option.flag_rel ||
+			     option.flag_mono || optind < argc)) {
+		fprintf(stderr, "Option '--merge' cannot be used with '-i', '-s', '-r', '-m' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (reorder_option != NULL && !option.reorder) {
+		fprintf(stderr, "Option '%s' requires '--reorder'.\n", reorder_option);
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.reorder && (option.command != NULL || option.ninputs > 0 || option.replay || option.gen.family != NULL)) {
+		fprintf(stderr, "Option '--reorder' cannot be used with a command, '--input', '--replay' or '--generate'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.reorder && (option.flag_inc || option.flag_sincestart || option.flag_rel ||
+			       option.flag_mono || optind < argc || option.truncate_long_lines)) {
+		fprintf(stderr, "Option '--reorder' cannot be used with '-i', '-s', '-r', '-m', '--long-lines truncate' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.range && (option.command != NULL || option.ninputs > 0 || option.replay ||
+			     option.gen.family != NULL || option.reorder)) {
+		fprintf(stderr, "Options '--from' and '--to' cannot be used with a command, '--input', '--replay', '--generate' or '--reorder'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((option.archive != NULL || option.query != NULL) &&
+	    (option.command != NULL || option.ninputs > 0 || option.replay || option.gen.family != NULL ||
+	     option.reorder || option.max_line_bytes != 0)) {
+		fprintf(stderr, "Options '--archive' and '--query' cannot be used with a command, '--input', '--replay', '--generate', '--reorder' or '--max-line-bytes'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((option.archive != NULL || option.query != NULL) &&
+	    (option.flag_inc || option.flag_sincestart || option.flag_rel || option.flag_mono)) {
+		fprintf(stderr, "Options '--archive' and '--query' cannot be used with '-i', '-s', '-r' or '-m'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.archive != NULL && (option.query != NULL || option.range || optind < argc)) {
+		fprintf(stderr, "Option '--archive' cannot be used with '--query', '--from', '--to' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.json && (option.binary || option.decode || option.split_output != NULL || option.merge ||
+			    option.reorder || option.range || option.replay || option.archive != NULL || option.query != NULL)) {
+		fprintf(stderr, "Option '--json' can only be used when stamping input, and not with '--binary' or '--split-output'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.binary && (option.flag_inc || option.flag_sincestart || option.flag_rel || optind < argc)) {
+		fprintf(stderr, "Option '--binary' cannot be used with '-i', '-s', '-r' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((option.binary || option.decode) &&
+	    (option.split_output != NULL || option.merge || option.reorder || option.range || option.replay ||
+	     option.archive != NULL || option.query != NULL)) {
+		fprintf(stderr, "Options '--binary' and '--decode' can only be used when stamping input.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.decode && (option.binary || option.command != NULL || option.ninputs > 0 || option.gen.family != NULL ||
+			      option.flag_inc || option.flag_sincestart || option.flag_rel || option.flag_mono)) {
+		fprintf(stderr, "Option '--decode' cannot be used with '--binary', a command, '--input', '--generate', '-i', '-s', '-r' or '-m'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.count_per != 0 && option.query == NULL) {
+		fprintf(stderr, "Option '--count-per' requires '--query'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.range && option.query == NULL && (option.flag_inc || option.flag_sincestart || option.flag_rel ||
+						      option.flag_mono || optind < argc)) {
+		fprintf(stderr, "Options '--from' and '--to' cannot be used with '-i', '-s', '-r', '-m' or a format.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.keep_cr && !option.pty) {
+		fprintf(stderr, "Option '--keep-cr' requires '--pty'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.output != NULL && (option.split_output != NULL || option.archive != NULL)) {
+		fprintf(stderr, "Option '--output' cannot be used with '--split-output' or '--archive'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.compress != COMPRESS_NONE && option.output == NULL) {
+		fprintf(stderr, "Option '--compress' requires '--output'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (output_option != NULL && option.output == NULL) {
+		fprintf(stderr, "Option '%s' requires '--output'.\n", output_option);
+		exit(EXIT_FAILURE);
+	}
+
+	if (shard_files_option && option.shard == NULL) {
+		fprintf(stderr, "Option '--shard-files' requires '--shard'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.shard != NULL &&
+	    (option.output != NULL || option.split_output != NULL || option.merge || option.reorder || option.range ||
+	     option.replay || option.archive != NULL || option.query != NULL || option.binary || option.decode || option.json)) {
+		fprintf(stderr, "Option '--shard' can only be used when stamping text to stdout, and not with '--output' or '--split-output'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (ring_option != NULL && option.ring == 0) {
+		fprintf(stderr, "Option '%s' requires '--ring'.\n", ring_option);
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.ring != 0 && (option.ring_dump == NULL || *option.ring_dump == '\0')) {
+		fprintf(stderr, "Option '--ring' requires '--ring-dump'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.ring_after != 0 && option.ring_trigger == NULL) {
+		fprintf(stderr, "Option '--after-trigger' requires '--trigger'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.ring != 0 &&
+	    (option.output != NULL || option.shard != NULL || option.split_output != NULL || option.binary ||
+	     option.archive != NULL)) {
+		fprintf(stderr, "Option '--ring' cannot be used with '--output', '--shard', '--split-output', '--binary' or '--archive'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((option.nmatch > 0 || option.nexclude > 0) &&
+	    (option.merge || option.reorder || option.range || option.replay || option.archive != NULL ||
+	     option.query != NULL || option.decode)) {
+		fprintf(stderr, "Options '--match' and '--exclude' can only be used when stamping input.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.lossy != 0 &&
+	    (option.shard != NULL || option.split_output != NULL || option.binary || option.json || option.archive != NULL)) {
+		fprintf(stderr, "Option '--lossy' cannot be used with '--shard', '--split-output', '--binary', '--json' or '--archive'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (compress_option != NULL && option.compress == COMPRESS_NONE) {
+		fprintf(stderr, "Option '%s' requires '--compress'.\n", compress_option);
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.compress_threads > 0 && option.compress != COMPRESS_ZSTD) {
+		fprintf(stderr, "Option '--compress-threads' requires '--compress zstd'.\n");
+		exit(EXIT_FAILURE);
+	}
+
+#ifndef TS_ZLIB
+	if (option.compress == COMPRESS_GZIP) {
+		fprintf(stderr, "Error: --compress gzip: ts was built without zlib (make USE_ZLIB=1).\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+#ifndef TS_ZSTD
+	if (option.compress == COMPRESS_ZSTD) {
+		fprintf(stderr, "Error: --compress zstd: ts was built without libzstd (make USE_ZSTD=1).\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	if (gen_option != NULL && option.gen.family == NULL) {
+		fprintf(stderr, "Option '%s' requires '--generate'.\n", gen_option);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * %b = Abbreviated month name
+	 * %d = The day of the month as a decimal number
+	 * %H = Hours
+	 * % %M = Minutes
+	 * % %S = Seconds
+	 */
+	const char *final_format = "%b %d %H:%M:%S";
+
+	if (optind < argc) {
+		final_format = argv[optind];
+	}
+
+	// ts sets TZ for itself, here and in main(); the command gets
+	// what ts was started with.
+	const char *tz = getenv("TZ");
+	if (option.command != NULL && tz != NULL && (option.tz = strdup(tz)) == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+
+	if (option.flag_inc || option.flag_sincestart) {
+		// This is a departure from the moreutils version of
+		// ts. If we have a user-supplied format, then use
+		// that in preference to %H:%M:%S.
+		if (optind == argc) {
+			final_format = "%H:%M:%S";
+		}
+		setenv("TZ", "GMT", 1);
+		tzset();
+	}
+
+	option.format = final_format;
+	option.hires_timestamping = count_microsecond_specifiers(option.format) > 0 || option.flag_mono;
+	option.user_format_specified = optind < argc;
+
+	return option;
+}
+
+static void test_precision_variations(void)
+{
+	composite_time comp_time;
+	time_t timestamp;
+
+	// Test rounding up with precision level 3; hours increase due
+	// to minutes and seconds.
+	COMP_TIME_INIT(comp_time, 1, 2, 3, 45, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 1, 2, 4, 0, 0);
+
+	// Test detailed representation with precision level 4;
+	// minutes increase due to seconds.
+	COMP_TIME_INIT(comp_time, 1, 2, 3, 45, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 1, 2, 3, 46, 0);
+
+	// Test with 59 minutes, 59 seconds at precision level 4;
+	// expecting no change since all units are significant.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 59, 59);
+
+	// Test with 1 hour, 59 minutes, 59 seconds at precision level
+	// 3; expecting no change as rounding not applied due to
+	// precision.
+	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 1, 59, 59);
+
+	// Test rounding up from minutes to hours with precision level
+	// 2; hours should increase, minutes reset.
+	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 2, 0, 0);
+
+	// Simplify to most significant unit (days) with precision
+	// level 1 from days, hours, and minutes.
+	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	assert(timestamp == 95310);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(1, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+
+	// Retain days and hours with precision level 2, simplifying
+	// minutes and seconds.
+	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	assert(timestamp == 95310);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 0, 0);
+
+	// Retain days, hours, and approximate minutes with precision
+	// level 3.
+	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	assert(timestamp == 95310);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 29, 0);
+
+	// Full detail maintained with precision level 4, no
+	// approximation.
+	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	assert(timestamp == 95310);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 28, 30);
+
+	// Test high precision with minimal input (1 second), expecting no approximation.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 1);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 1);
+
+	// Test for minute to hour rollover with precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 2, 0, 0);
+
+	// Test for no change with hours near maximum but within
+	// precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 0, 23, 45, 0);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 23, 45, 0);
+
+	// Test day to year rollover with precision level 2; days
+	// reset, year increments.
+	COMP_TIME_INIT(comp_time, 1, 364, 23, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 2, 0, 0, 0, 0);
+
+	// Test handling when non-zero units exceed precision level 2;
+	// hours and less significant units reset.
+	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+
+	// Test handling when all units are set to zero, with precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 0);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 0);
+
+	// Test edge case for seconds rolling over to minutes, with
+	// precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 59, 59);
+
+	// Test high precision with minimal input (1 second), expecting no approximation.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 1);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 1);
+
+	// Test rollover across multiple units (seconds to minutes to
+	// hours), with precision level 3.
+	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 23, 59, 59);
+
+	// Test mixed zero and non-zero units, with precision level 2.
+	COMP_TIME_INIT(comp_time, 1, 0, 1, 0, 1);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 1, 0, 1, 0, 0);
+
+	// Test days to years rollover with minimal hours input, with
+	// precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 364, 23, 0, 0);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 364, 23, 0, 0);
+
+	// Test with maximum values just before rollover for each
+	// unit, with precision level 4. Expecting no change with
+	// precision 4, as all units are significant.
+	COMP_TIME_INIT(comp_time, 0, 364, 23, 59, 59);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+
+	COMP_TIME_ASSERT(comp_time, 0, 364, 23, 59, 59);
+
+	// Test handling of cascading rollover from minutes to hours
+	// to days, with precision level 2.
+	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(2, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+
+	// Test transition at midnight with precision level 3.
+	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 60);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+
+	// Test with minimal non-zero units and lower precision.
+	COMP_TIME_INIT(comp_time, 0, 0, 0, 1, 30);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(1, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 2, 0);
+
+	// Test sparse non-zero units with high precision.
+	COMP_TIME_INIT(comp_time, 1, 0, 0, 0, 5);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(4, comp_time);
+	COMP_TIME_ASSERT(comp_time, 1, 0, 0, 0, 5);
+
+	// Test rounding in the middle of the spectrum with precision
+	// 3. Assuming no change as it's already concise.
+	COMP_TIME_INIT(comp_time, 0, 0, 12, 30, 0);
+	timestamp = composite_time_to_seconds(comp_time);
+	seconds_to_composite_time(timestamp, comp_time);
+	approximate_time(3, comp_time);
+	COMP_TIME_ASSERT(comp_time, 0, 0, 12, 30, 0);
+}
+
+static volatile sig_atomic_t signal_received;
+
+static void signal_handler(int sig)
+{
+	signal_received = sig;
+}
+
+// Little-endian integers and LEB128 varints for the binary formats
+// (--binary, --archive).
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4; i++)
+		v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+#define VARINT_MAX 10
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+// Decodes a varint from [*p, end), advancing *p past it. Returns
+// false if it is truncated or too long.
+static bool get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	*v = 0;
+
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// CRC-32 (IEEE 802.3, as in zlib and gzip).
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	static uint32_t table[256];
+	const unsigned char *p = data;
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len-- > 0)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void test_binary_encoding(void)
+{
+	static const uint64_t values[] = {
+		0, 1, 0x7f, 0x80, 0x3fff, 0x4000, UINT32_MAX, (uint64_t)UINT32_MAX + 1,
+		INT64_MAX, (uint64_t)INT64_MAX + 1, UINT64_MAX,
+	};
+	static const int64_t deltas[] = { 0, 1, -1, 63, -64, INT32_MIN, INT64_MAX, INT64_MIN };
+	unsigned char buf[VARINT_MAX];
+	const unsigned char *p;
+	uint64_t v;
+
+	// Each varint decodes back to its value, using every byte, and
+	// fails to decode with its last byte missing.
+	for (size_t i = 0; i < NELEMENTS(values); i++) {
+		size_t n = put_varint(buf, values[i]);
+		assert(n >= 1 && n <= VARINT_MAX);
+		p = buf;
+		assert(get_varint(&p, buf + n, &v) && v == values[i] && p == buf + n);
+		p = buf;
+		assert(!get_varint(&p, buf + n - 1, &v));
+	}
+	assert(put_varint(buf, 0x7f) == 1);
+	assert(put_varint(buf, 0x80) == 2);
+	assert(put_varint(buf, UINT64_MAX) == VARINT_MAX);
+
+	// Small deltas of either sign stay small, and the extremes
+	// round-trip.
+	for (size_t i = 0; i < NELEMENTS(deltas); i++)
+		assert(unzigzag(zigzag(deltas[i])) == deltas[i]);
+	assert(zigzag(-1) == 1 && zigzag(1) == 2 && zigzag(-64) == 127);
+	assert(zigzag(INT64_MAX) == UINT64_MAX - 1 && zigzag(INT64_MIN) == UINT64_MAX);
+
+	put_le64(buf, 0x0102030405060708);
+	assert(buf[0] == 0x08 && buf[7] == 0x01 && get_le64(buf) == 0x0102030405060708);
+	put_le64(buf, UINT64_MAX);
+	assert(get_le64(buf) == UINT64_MAX);
+	put_le32(buf, 0x01020304);
+	assert(buf[0] == 0x04 && buf[3] == 0x01 && get_le32(buf) == 0x01020304);
+
+	// The standard check value, also computed in two steps.
+	assert(crc32_update(0, "", 0) == 0);
+	assert(crc32_update(0, "123456789", 9) == 0xcbf43926);
+	assert(crc32_update(crc32_update(0, "1234", 4), "56789", 5) == 0xcbf43926);
+}
+
+static bool write_binary_header(FILE *out, unsigned fields)
+{
+	unsigned char header[BINARY_HEADER] = BINARY_MAGIC;
+
+	header[6] = BINARY_VERSION;
+	header[7] = fields & ~BINARY_ON;
+	return fwrite(header, 1, sizeof(header), out) == sizeof(header);
+}
+
+static bool write_record(const struct ts_opt *opt, struct ts_fmt *fmt, const struct stamp_source *src, const char *line, size_t line_len, int64_t ns)
+{
+	unsigned char header[3 * VARINT_MAX + 8];
+	size_t n = put_varint(header, (uint64_t)line_len << 1 | src->reader.continuation);
+
+	put_le64(header + n, ns);
+	n += 8;
+	if (opt->binary & BINARY_SOURCE)
+		n += put_varint(header + n, src->id);
+	if (opt->binary & BINARY_SEQ)
+		n += put_varint(header + n, fmt->seq++);
+
+	return fwrite(header, 1, n, src->out) == n && fwrite(line, 1, line_len, src->out) == line_len;
+}
+
+static size_t json_key(char *out, const char *name, bool first)
+{
+	size_t n = strlen(name);
+	size_t o = 0;
+
+	if (!first)
+		out[o++] = ',';
+	out[o++] = '"';
+	memcpy(out + o, name, n);
+	o += n;
+	out[o++] = '"';
+	out[o++] = ':';
+	return o;
+}
+
+// Writes one line as a JSON object (--json): the time in the format
+// given and in nanoseconds, with -r the time found in the line in
+// place of the former and in nanoseconds, a sequence number, the
+// source's tag if it has one and the line itself, without its
+// newline. Fields whose name is empty are left out.
+static bool write_json(const struct ts_opt *opt, struct ts_fmt *fmt, const struct stamp_source *src, char *line, size_t line_len, struct timespec now)
+{
+	const char *const *names = opt->json_names;
+	struct timespec parsed;
+	size_t match_end = 0;
+	size_t tag_len = src->tag != NULL ? strlen(src->tag) : 0;
+	size_t need = 6 * (line_len + tag_len + fmt->bufsz) + 256;
+	bool first = true;
+	size_t o = 0;
+
+	for (int i = 0; i < JSON_FIELD_COUNT; i++)
+		need += strlen(names[i]);
+
+	if (need > fmt->jsonsz) {
+		char *p = realloc(fmt->json, need);
+		if (p == NULL)
+			return false;
+		fmt->json = p;
+		fmt->jsonsz = need;
+	}
+
+	char *out = fmt->json;
+	bool have_ts = true;
+
+	if (opt->flag_rel)
+		have_ts = fmt_time_rel(fmt, line, line_len, &match_end, now, &parsed);
+	else
+		fmt_time_now(fmt, now);
+
+	out[o++] = '{';
+
+	if (have_ts && *names[JSON_TS] != '\0') {
+		o += json_key(out + o, names[JSON_TS], first);
+		out[o++] = '"';
+		o += json_escape(out + o, fmt->buf, strlen(fmt->buf));
+		out[o++] = '"';
+		first = false;
+	}
+
+	if (*names[JSON_TS_NS] != '\0') {
+		o += json_key(out + o, names[JSON_TS_NS], first);
+		o += write_ull_padded(out, o, timespec_to_ns(&now), 0);
+		first = false;
+	}
+
+	if (opt->flag_rel && have_ts && *names[JSON_PARSED_NS] != '\0') {
+		o += json_key(out + o, names[JSON_PARSED_NS], first);
+		int64_t ns = timespec_to_ns(&parsed);
+		if (ns < 0) {
+			out[o++] = '-';
+			ns = -ns;
+		}
+		o += write_ull_padded(out, o, ns, 0);
+		first = false;
+	}
+
+	if (*names[JSON_SEQ] != '\0') {
+		o += json_key(out + o, names[JSON_SEQ], first);
+		o += write_ull_padded(out, o, fmt->seq++, 0);
+		first = false;
+	}
+
+	if (src->tag != NULL && *names[JSON_SOURCE] != '\0') {
+		o += json_key(out + o, names[JSON_SOURCE], first);
+		out[o++] = '"';
+		o += json_escape(out + o, src->tag, tag_len);
+		out[o++] = '"';
+		first = false;
+	}
+
+	if (*names[JSON_LINE] != '\0') {
+		if (line_len > 0 && line[line_len - 1] == '\n')
+			line_len--;
+		o += json_key(out + o, names[JSON_LINE], first);
+		out[o++] = '"';
+		o += json_escape(out + o, line, line_len);
+		out[o++] = '"';
+	}
+
+	out[o++] = '}';
+	out[o++] = '\n';
+
+	return fwrite(out, 1, o, src->out) == o;
+}
+
+// --shard TEMPLATE: each stamped line goes to the file named by
+// formatting its time with TEMPLATE (strftime(3)), e.g.
+// out/%Y%m%d/%H.log, instead of to stdout. With -r the time is the
+// one found in the line, if any. Up to --shard-files files are kept
+// open, most recently used first; one pushed out is handed to a
+// closer thread that fsyncs and closes it, so the stamping thread
+// never waits on the disk when time moves on to the next bucket.
+#define SHARD_CLOSE_QUEUE 64
+
+struct shard {
+	FILE *f;
+	char *path;
+	uint64_t used;		// For least recently used.
+};
+
+struct shard_set {
+	const char *template;
+	struct shard *slots;
+	size_t nslots;
+	uint64_t clock;
+	time_t sec;		// Second of the last lookup, or -1.
+	struct shard *last;	// Its result.
+	char path[PATH_MAX];
+
+	// Files waiting for the closer thread.
+	pthread_t closer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct shard queue[SHARD_CLOSE_QUEUE];
+	size_t head, count;
+	bool done;
+	bool failed;
+};
+
+static void *shard_closer(void *arg)
+{
+	struct shard_set *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (s->count == 0 && !s->done)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->count == 0)
+			break;
+
+		struct shard sh = s->queue[s->head];
+		s->head = (s->head + 1) % SHARD_CLOSE_QUEUE;
+		s->count--;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		bool ok = fflush(sh.f) == 0 && fsync(fileno(sh.f)) == 0;
+		if (fclose(sh.f) != 0)
+			ok = false;
+		if (!ok)
+			fprintf(stderr, "Error: %s: %s.\n", sh.path, strerror(errno));
+		free(sh.path);
+
+		pthread_mutex_lock(&s->lock);
+		s->failed |= !ok;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+// Hands a shard to the closer thread, waiting if it is behind.
+static void shard_retire(struct shard_set *s, struct shard *sh)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->count == SHARD_CLOSE_QUEUE)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->queue[(s->head + s->count++) % SHARD_CLOSE_QUEUE] = *sh;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	*sh = (struct shard){ 0 };
+	s->sec = -1;
+}
+
+static struct shard_set *shards_init(const struct ts_opt *opt)
+{
+	struct shard_set *s = calloc(1, sizeof(*s));
+
+	if (s == NULL || (s->slots = calloc(opt->shard_files, sizeof(*s->slots))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	s->template = opt->shard;
+	s->nslots = opt->shard_files;
+	s->sec = -1;
+
+	if ((errno = pthread_mutex_init(&s->lock, NULL)) != 0 ||
+	    (errno = pthread_cond_init(&s->cond, NULL)) != 0 ||
+	    (errno = start_thread(&s->closer, shard_closer, s)) != 0) {
+		perror("shard closer");
+		exit(EXIT_FAILURE);
+	}
+
+	return s;
+}
+
+// Closes every shard and waits for them to reach the disk. Returns
+// false if any of them could not be written.
+static bool shards_free(struct shard_set *s)
+{
+	if (s == NULL)
+		return true;
+
+	for (size_t i = 0; i < s->nslots; i++) {
+		if (s->slots[i].f != NULL)
+			shard_retire(s, &s->slots[i]);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->done = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->closer, NULL);
+
+	bool ok = !s->failed;
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->slots);
+	free(s);
+
+	return ok;
+}
+
+// Creates the directories leading up to path.
+static void make_parents(char *path)
+{
+	for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0777) != 0 && errno != EEXIST)
+			fprintf(stderr, "Error: mkdir %s: %s.\n", path, strerror(errno));
+		*p = '/';
+	}
+}
+
+static void shard_failed(struct shard_set *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->failed = true;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Returns the file for a line stamped at t, opening it if need be.
+static FILE *shard_file(struct shard_set *s, struct timespec t)
+{
+	struct tm tm;
+
+	if (t.tv_sec == s->sec)
+		return s->last->f;
+
+	if (localtime_r(&t.tv_sec, &tm) == NULL ||
+	    strftime(s->path, sizeof(s->path), s->template, &tm) == 0) {
+		fprintf(stderr, "Error: --shard %s: cannot format the time.\n", s->template);
+		shard_failed(s);
+		return NULL;
+	}
+
+	struct shard *sh = NULL;
+	struct shard *victim = &s->slots[0];
+	for (size_t i = 0; i < s->nslots && sh == NULL; i++) {
+		if (s->slots[i].f != NULL && strcmp(s->slots[i].path, s->path) == 0)
+			sh = &s->slots[i];
+		else if (s->slots[i].f == NULL || (victim->f != NULL && s->slots[i].used < victim->used))
+			victim = &s->slots[i];
+	}
+
+	if (sh == NULL) {
+		sh = victim;
+		if (sh->f != NULL)
+			shard_retire(s, sh);
+
+		make_parents(s->path);
+		if ((sh->path = strdup(s->path)) == NULL ||
+		    (sh->f = fopen(s->path, "a")) == NULL ||
+		    setvbuf(sh->f, NULL, _IOLBF, BUFSIZ) != 0) {
+			fprintf(stderr, "Error: %s: %s.\n", s->path, strerror(errno));
+			if (sh->f != NULL)
+				fclose(sh->f);
+			free(sh->path);
+			*sh = (struct shard){ 0 };
+			shard_failed(s);
+			return NULL;
+		}
+	}
+
+	sh->used = ++s->clock;
+	s->sec = t.tv_sec;
+	s->last = sh;
+	return sh->f;
+}
+
+// Timestamps one line and writes it to src->out, or to its --shard
+// file. line must have one addressable byte past its end (see
+// read_line()).
+static bool stamp_line(const struct ts_opt *opt, struct ts_fmt *fmt, const struct stamp_source *src, char *line, ssize_t line_len, long *secs, long *nsecs, long monodelta)
+{
+	TS_PROBE1(line_read, line_len);
+
+	// The clock is read before filtering, so that the time is when
+	// the line arrived rather than when it was matched.
+	long last_secs = *secs;
+	long last_nsecs = *nsecs;
+	struct timespec now;
+	if (!gettime(opt, &now, secs, nsecs, monodelta)) {
+		perror("gettime");
+		return false;
+	}
+
+	TS_PROBE2(clock_read, now.tv_sec, now.tv_nsec);
+
+	// The rest of a long line goes wherever its start went.
+	fmt->filtered = fmt->filter_data != NULL && !src->reader.continuation && !filter_line(fmt, line, line_len);
+	if (fmt->filtered) {
+		// -i counts from the last line written.
+		*secs = last_secs;
+		*nsecs = last_nsecs;
+		return true;
+	}
+
+	if (opt->binary) {
+		if (!write_record(opt, fmt, src, line, line_len, timespec_to_ns(&now))) {
+			perror("write");
+			return false;
+		}
+		return true;
+	}
+
+	if (opt->json) {
+		if (!write_json(opt, fmt, src, line, line_len, now)) {
+			perror("write");
+			return false;
+		}
+		return true;
+	}
+
+	struct timespec parsed;
+	size_t offset = 0;
+	bool found = false;
+	FILE *out = src->out;
+
+	if (opt->flag_rel)
+		found = fmt_time_rel(fmt, line, line_len, &offset, now, &parsed);
+	else
+		fmt_time_now(fmt, now);
+
+	TS_PROBE1(format_done, fmt->buf);
+
+	if (fmt->shards != NULL && out == stdout) {
+		fmt->shard_time = found ? parsed : now;
+		if ((out = shard_file(fmt->shards, fmt->shard_time)) == NULL)
+			return false;
+	}
+
+	int rc = 0;
+	if (fputs(fmt->buf, out) == EOF ||
+	    (!opt->flag_rel && putc(' ', out) == EOF) ||
+	    (src->tag != NULL && (fputs(src->tag, out) == EOF || putc(' ', out) == EOF)) ||
+	    fwrite(line + offset, 1, line_len - offset, out) != (size_t)line_len - offset)
+		rc = -1;
+
+	TS_PROBE1(write_done, rc);
+
+	if (rc < 0) {
+		perror("write");
+		return false;
+	}
+
+	return true;
+}
+
+// Stamps a line read from src, or passes through the rest of a line
+// longer than --max-line-bytes; that was stamped when its first piece
+// was read. Returns false if writing failed.
+static bool stamp_source_line(const struct ts_opt *opt, struct ts_fmt *fmt, struct stamp_source *src, char *line, ssize_t line_len, long *secs, long *nsecs, long monodelta)
+{
+	FILE *out = src->out;
+	int rc;
+
+	if (src->strip_cr && line_len >= 2 && line[line_len - 2] == '\r' && line[line_len - 1] == '\n')
+		line[--line_len - 1] = '\n';
+
+	if (!src->reader.continuation) {
+		if (!stamp_line(opt, fmt, src, line, line_len, secs, nsecs, monodelta))
+			return false;
+		src->truncated_bytes = 0;
+		src->shard_time = fmt->shard_time;
+		src->filtered = fmt->filtered;
+		return true;
+	}
+
+	if (src->filtered)
+		return true;
+
+	// A record cannot be extended: with --binary or --json the rest
+	// of the line is dropped, or written as records of its own.
+	if (opt->binary || opt->json)
+		return opt->truncate_long_lines || stamp_line(opt, fmt, src, line, line_len, secs, nsecs, monodelta);
+
+	if (opt->truncate_long_lines) {
+		src->truncated_bytes += line_len;
+		if (src->reader.fragment)
+			return true;
+	}
+
+	// The rest of the line follows its start into the same shard.
+	if (fmt->shards != NULL && out == stdout && (out = shard_file(fmt->shards, src->shard_time)) == NULL)
+		return false;
+
+	if (opt->truncate_long_lines) {
+		bool newline = line[line_len - 1] == '\n';
+		rc = fprintf(out, " [truncated %llu bytes]%s", src->truncated_bytes - newline, newline ? "\n" : "");
+	} else {
+		rc = fwrite(line, 1, line_len, out) == (size_t)line_len ? 0 : -1;
+	}
+
+	if (rc < 0) {
+		perror("write");
+		return false;
+	}
+
+	return true;
+}
+
+// Called at the end of src's input.
+static void stamp_source_eof(const struct ts_opt *opt, struct ts_fmt *fmt, struct stamp_source *src)
+{
+	FILE *out = src->out;
+
+	// Input ended in the middle of a truncated line.
+	if (src->filtered || !src->reader.continuation || !opt->truncate_long_lines || opt->binary || opt->json)
+		return;
+
+	if (fmt->shards != NULL && out == stdout)
+		out = shard_file(fmt->shards, src->shard_time);
+	if (out != NULL)
+		fprintf(out, " [truncated %llu bytes]", src->truncated_bytes);
+}
+
+// Stamps each line of src.
+static void stamp_lines(const struct ts_opt *opt, struct ts_fmt *fmt, struct stamp_source *src, long *secs, long *nsecs, long monodelta)
+{
+	while (!signal_received) {
+		char *line;
+		ssize_t line_len = read_line(&src->reader, &line, &signal_received);
+
+		if (line_len == 0) {
+			stamp_source_eof(opt, fmt, src);
+			break;
+		}
+
+		if (line_len == -1) {
+			if (errno != EINTR)
+				perror("read");
+			break;
+		}
+
+		if (!stamp_source_line(opt, fmt, src, line, line_len, secs, nsecs, monodelta))
+			break;
+
+		ALLOC_CHECK_LINE();
+	}
+}
+
+// The child in command mode (ts -- command), for forward_signal().
+static volatile pid_t child_pid;
+
+static void forward_signal(int sig, siginfo_t *info, void *context)
+{
+	(void)context;
+
+	// A signal from the terminal (e.g., ^C) is sent to the whole
+	// foreground process group and so reaches the child anyway;
+	// only pass on those that were sent to ts itself.
+	bool sent = info->si_code == SI_USER || info->si_code == SI_QUEUE;
+#ifdef SI_TKILL
+	sent = sent || info->si_code == SI_TKILL;
+#endif
+
+	if (sent && child_pid > 0)
+		kill(child_pid, sig);
+}
+
+// Reads from every source as input arrives and stamps each line as
+// soon as it is read, keeping partial lines apart per source, until
+// all of them have reached end of input, a signal stops ts, or a
+// write fails. Sources that cannot be polled (regular files) are
+// always ready, and are read in turn with those that are.
+static void stamp_sources(const struct ts_opt *opt, struct ts_fmt *fmt, struct stamp_source *sources, size_t nsources, long *secs, long *nsecs, long monodelta)
+{
+	struct poller poller;
+	bool always_ready[POLLER_MAX] = { false };
+	bool done[POLLER_MAX] = { false };
+	size_t nalways_ready = 0;
+	size_t nopen = nsources;
+	bool write_error = false;
+
+	assert(nsources <= POLLER_MAX);
+
+	if (!poller_init(&poller)) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < nsources; i++) {
+		if (poller_add(&poller, sources[i].reader.fd, i))
+			continue;
+		if (errno != EPERM) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+		always_ready[i] = true;
+		nalways_ready++;
+	}
+
+	while (nopen > 0 && !write_error && !signal_received) {
+		int ready[POLLER_MAX];
+		int n = poller_wait(&poller, ready, nsources, nalways_ready > 0 ? 0 : -1);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (size_t i = 0; i < nsources && nalways_ready > 0; i++) {
+			if (always_ready[i] && !done[i])
+				ready[n++] = i;
+		}
+
+		for (int i = 0; i < n && !write_error; i++) {
+			struct stamp_source *src = &sources[ready[i]];
+
+			if (fill_line_buffer(&src->reader) == -1) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				// A pty master reads EIO once the slave has
+				// been closed.
+				if (errno != EIO)
+					perror("read");
+				src->reader.eof = true;
+			}
+
+			char *line;
+			ssize_t line_len;
+
+			while ((line_len = next_buffered_line(&src->reader, &line)) > 0) {
+				if (!stamp_source_line(opt, fmt, src, line, line_len, secs, nsecs, monodelta)) {
+					write_error = true;
+					break;
+				}
+				ALLOC_CHECK_LINE();
+			}
+
+			if (src->reader.eof && !write_error) {
+				stamp_source_eof(opt, fmt, src);
+				if (always_ready[ready[i]])
+					nalways_ready--;
+				else
+					poller_remove(&poller, src->reader.fd);
+				done[ready[i]] = true;
+				nopen--;
+			}
+		}
+	}
+
+	ALLOC_CHECK_STOP();
+	poller_free(&poller);
+}
+
+// Opens the inputs given with --input, each [LABEL=]SOURCE: a path,
+// "-" for stdin or "fd:N" for an inherited descriptor. LABEL, which
+// defaults to the last component of the path, tags the input's lines
+// on stdout, unless --split-output is given, in which case each input
+// is written, untagged, to DIR/LABEL (appended to if it exists). With
+// nonblock, paths are opened without blocking so that FIFOs whose
+// writers have not turned up yet do not hold up the rest.
+static struct stamp_source *open_inputs(const struct ts_opt *opt, bool nonblock)
+{
+	struct stamp_source *sources = calloc(opt->ninputs, sizeof(*sources));
+	size_t max_bufsz = opt->max_line_bytes ? opt->max_line_bytes + 1 : 0;
+
+	if (sources == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < opt->ninputs; i++) {
+		char *spec = opt->inputs[i];
+		char *eq = strchr(spec, '=');
+		const char *path = eq != NULL ? eq + 1 : spec;
+		const char *label;
+		char *endptr;
+		int fd;
+
+		if (strcmp(path, "-") == 0) {
+			fd = STDIN_FILENO;
+			label = "stdin";
+		} else if (strncmp(path, "fd:", 3) == 0) {
+			errno = 0;
+			long n = strtol(path + 3, &endptr, 10);
+			if (errno != 0 || endptr == path + 3 || *endptr != '\0' || n < 0 || n > INT_MAX) {
+				fprintf(stderr, "Error: --input %s: invalid file descriptor.\n", spec);
+				exit(EXIT_FAILURE);
+			}
+			fd = n;
+			if (fcntl(fd, F_GETFL) == -1) {
+				fprintf(stderr, "Error: --input %s: %s.\n", spec, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			label = path;
+		} else {
+			fd = open(path, O_RDONLY | (nonblock ? O_NONBLOCK : 0));
+			if (fd == -1) {
+				fprintf(stderr, "Error: --input %s: %s.\n", path, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			label = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+		}
+
+		if (eq != NULL) {
+			*eq = '\0';
+			label = spec;
+		}
+
+		if (!line_reader_init(&sources[i].reader, fd, LINE_BUFSZ, max_bufsz)) {
+			perror("line buffer");
+			exit(EXIT_FAILURE);
+		}
+
+		// Only files: looking at a live stream could block.
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+			line_reader_decompress(&sources[i].reader, path);
+
+		sources[i].id = i;
+
+		if (opt->split_output == NULL) {
+			sources[i].out = stdout;
+			sources[i].tag = *label != '\0' ? label : NULL;
+			continue;
+		}
+
+		char out_path[PATH_MAX];
+		if (*label == '\0' || strchr(label, '/') != NULL ||
+		    snprintf(out_path, sizeof(out_path), "%s/%s", opt->split_output, label) >= (int)sizeof(out_path)) {
+			fprintf(stderr, "Error: --input %s: label '%s' cannot be used as a file name.\n", path, label);
+			exit(EXIT_FAILURE);
+		}
+
+		if ((sources[i].out = fopen(out_path, "a")) == NULL ||
+		    setvbuf(sources[i].out, NULL, _IOLBF, BUFSIZ) != 0) {
+			fprintf(stderr, "Error: %s: %s.\n", out_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return sources;
+}
+
+static void close_inputs(const struct ts_opt *opt, struct stamp_source *sources)
+{
+	for (size_t i = 0; i < opt->ninputs; i++) {
+		line_reader_free(&sources[i].reader);
+		if (sources[i].reader.fd != STDIN_FILENO)
+			close(sources[i].reader.fd);
+		if (sources[i].out != stdout && fclose(sources[i].out) != 0)
+			perror("fclose");
+	}
+
+	free(sources);
+}
+
+// Stamps every --input as its lines arrive.
+static void stamp_inputs(const struct ts_opt *opt, struct ts_fmt *fmt, long *secs, long *nsecs, long monodelta)
+{
+	struct stamp_source *sources = open_inputs(opt, true);
+
+	stamp_sources(opt, fmt, sources, opt->ninputs, secs, nsecs, monodelta);
+	close_inputs(opt, sources);
+}
+
+// The pending line of one input in --merge.
+struct merge_head {
+	int64_t t;
+	char *line;
+	ssize_t len;
+};
+
+// Orders inputs by the timestamp of their pending line; ties go to
+// the input given first, so equal timestamps keep a stable order.
+static bool merge_before(const struct merge_head *heads, size_t a, size_t b)
+{
+	return heads[a].t < heads[b].t || (heads[a].t == heads[b].t && a < b);
+}
+
+static void merge_sift_down(const struct merge_head *heads, size_t *heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t min = i;
+		size_t left = 2 * i + 1;
+		size_t right = left + 1;
+
+		if (left < n && merge_before(heads, heap[left], heap[min]))
+			min = left;
+		if (right < n && merge_before(heads, heap[right], heap[min]))
+			min = right;
+		if (min == i)
+			return;
+
+		size_t tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+// Reads the next line of src into head. A line without a recognised
+// timestamp keeps the time of the line before it in the same input,
+// so that continuation lines (stack traces, say) stay with the line
+// they belong to; before the first timestamp that time is INT64_MIN.
+// Returns false at end of input or on error.
+static bool merge_next(struct stamp_source *src, struct merge_head *head, time_t now)
+{
+	ssize_t len = read_line(&src->reader, &head->line, &signal_received);
+
+	if (len <= 0) {
+		if (len == -1 && errno != EINTR)
+			perror("read");
+		return false;
+	}
+
+	struct tm parsed_tm;
+	struct timespec parsed;
+	size_t match_end;
+
+	head->len = len;
+	if (!src->reader.continuation && parse_timestamp(head->line, len, now, &parsed_tm, &parsed, &match_end))
+		head->t = timespec_to_ns(&parsed);
+
+	return true;
+}
+
+// Merges inputs that are each in time order into one stream in time
+// order (--merge), like sort -m but ordering by the timestamps that
+// ts recognises rather than by text. Only the pending line of each
+// input is held, in a min-heap keyed by its timestamp. Lines are
+// written as they are, after the input's label if it has one.
+static void merge_inputs(const struct ts_opt *opt, struct ts_fmt *fmt, long *secs, long *nsecs, long monodelta)
+{
+	struct stamp_source *sources = open_inputs(opt, false);
+	struct merge_head heads[POLLER_MAX];
+	size_t heap[POLLER_MAX];
+	size_t n = 0;
+	struct timespec now;
+
+	if (read_clock(CLOCK_REALTIME, &now, false) != 0) {
+		perror("clock_gettime");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < opt->ninputs; i++) {
+		heads[i].t = INT64_MIN;
+		if (merge_next(&sources[i], &heads[i], now.tv_sec))
+			heap[n++] = i;
+	}
+
+	for (size_t i = n / 2; i-- > 0;)
+		merge_sift_down(heads, heap, n, i);
+
+	while (n > 0 && !signal_received) {
+		size_t i = heap[0];
+		struct stamp_source *src = &sources[i];
+		bool more;
+
+		if ((src->tag != NULL && (fputs(src->tag, src->out) == EOF || putc(' ', src->out) == EOF)) ||
+		    fwrite(heads[i].line, 1, heads[i].len, src->out) != (size_t)heads[i].len) {
+			perror("write");
+			break;
+		}
+
+		// The rest of a line longer than --max-line-bytes
+		// follows it straight away.
+		src->truncated_bytes = 0;
+		while ((more = merge_next(src, &heads[i], now.tv_sec)) && src->reader.continuation) {
+			if (!stamp_source_line(opt, fmt, src, heads[i].line, heads[i].len, secs, nsecs, monodelta))
+				goto out;
+		}
+
+		if (!more) {
+			stamp_source_eof(opt, fmt, src);
+			heap[0] = heap[--n];
+		}
+
+		merge_sift_down(heads, heap, n, 0);
+
+		ALLOC_CHECK_LINE();
+	}
+
+out:
+	ALLOC_CHECK_STOP();
+	close_inputs(opt, sources);
+}
+
+// The terminal that the child's pty takes its window size from, if
+// ts runs on one.
+static int pty_master = -1;
+static int pty_size_source = -1;
+
+static void copy_window_size(void)
+{
+	struct winsize ws;
+
+	if (pty_size_source != -1 && ioctl(pty_size_source, TIOCGWINSZ, &ws) == 0)
+		ioctl(pty_master, TIOCSWINSZ, &ws);
+}
+
+// Opens a pseudo-terminal for the child's stdout (--pty); like
+// pipe(2), fds[0] is the end ts reads (the master) and fds[1] the end
+// the child writes (the slave). The pty gets the window size of ts's
+// terminal before the child can look at it.
+static int open_pty(int fds[2])
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	const char *name;
+	int slave;
+
+	if (master == -1)
+		return -1;
+
+	if (grantpt(master) != 0 || unlockpt(master) != 0 ||
+	    (name = ptsname(master)) == NULL ||
+	    (slave = open(name, O_RDWR | O_NOCTTY)) == -1) {
+		int err = errno;
+		close(master);
+		errno = err;
+		return -1;
+	}
+
+	pty_master = master;
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO && pty_size_source == -1; fd++) {
+		if (isatty(fd))
+			pty_size_source = fd;
+	}
+	copy_window_size();
+
+	fds[0] = master;
+	fds[1] = slave;
+	return 0;
+}
+
+static void resize_pty(int sig)
+{
+	int saved_errno = errno;
+
+	copy_window_size();
+
+	// The child gets SIGWINCH from the real terminal too, but may
+	// look at its pty before it has been resized; tell it again.
+	if (child_pid > 0)
+		kill(child_pid, sig);
+
+	errno = saved_errno;
+}
+
+// Runs opt->command with its stdout and stderr on separate pipes and
+// stamps each line as soon as it is read from either. Lines keep to
+// their stream unless --stream-tags is given, in which case both go
+// to stdout, tagged. Signals sent to ts are forwarded to the child,
+// and ts carries on until the child has closed both pipes.
+//
+// With --pty the child's stdout is a pseudo-terminal instead, so that
+// stdio keeps it line buffered rather than flushing in large, late
+// blocks; its window size follows the terminal ts runs on, and the
+// CRs that the terminal adds before each newline are removed unless
+// --keep-cr is given. The child stays in ts's process group, so ^C
+// and friends still reach it directly.
+//
+// @return The exit status for ts: the child's, or 128 plus the
+//         number of the signal that killed it.
+static int run_command(const struct ts_opt *opt, struct ts_fmt *fmt, long *secs, long *nsecs, long monodelta)
+{
+	static const int forwarded_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 };
+	struct stamp_source streams[] = {{
+			.out = stdout,
+			.tag = opt->stream_tags[0],
+			.strip_cr = opt->pty && !opt->keep_cr,
+		}, {
+			.out = opt->stream_tags[1] != NULL || opt->binary || opt->json ? stdout : stderr,
+			.tag = opt->stream_tags[1],
+			.id = 1,
+		},
+	};
+	int pipes[NELEMENTS(streams)][2];
+
+	// stderr is unbuffered; buffer it by line like stdout so that
+	// each stamped line is written at once.
+	if (setvbuf(stderr, NULL, _IOLBF, BUFSIZ) != 0) {
+		perror("setvbuf");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < NELEMENTS(streams); i++) {
+		if (i == 0 && opt->pty) {
+			if (open_pty(pipes[i]) != 0) {
+				perror("posix_openpt");
+				exit(EXIT_FAILURE);
+			}
+		} else if (pipe(pipes[i]) != 0) {
+			perror("pipe");
+			exit(EXIT_FAILURE);
+		}
+		if (!line_reader_init(&streams[i].reader, pipes[i][0], LINE_BUFSZ, opt->max_line_bytes ? opt->max_line_bytes + 1 : 0)) {
+			perror("line buffer");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Block the forwarded signals until the child's pid is known.
+	struct sigaction sa = { .sa_sigaction = forward_signal, .sa_flags = SA_SIGINFO };
+	sigset_t mask, old_mask;
+
+	sigemptyset(&sa.sa_mask);
+	sigemptyset(&mask);
+	for (size_t i = 0; i < NELEMENTS(forwarded_signals); i++)
+		sigaddset(&mask, forwarded_signals[i]);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (size_t i = 0; i < NELEMENTS(forwarded_signals); i++) {
+		// SIGHUP reopens --output and SIGUSR2 dumps --ring;
+		// those stay with ts.
+		if ((forwarded_signals[i] == SIGHUP && opt->output != NULL) ||
+		    (forwarded_signals[i] == SIGUSR2 && opt->ring != 0))
+			continue;
+		if (sigaction(forwarded_signals[i], &sa, NULL) == -1) {
+			perror("sigaction");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		if (dup2(pipes[0][1], STDOUT_FILENO) == -1 || dup2(pipes[1][1], STDERR_FILENO) == -1 ||
+		    (opt->tz != NULL ? setenv("TZ", opt->tz, 1) : unsetenv("TZ")) != 0)
+			_exit(126);
+		for (size_t i = 0; i < NELEMENTS(streams); i++) {
+			close(pipes[i][0]);
+			close(pipes[i][1]);
+		}
+		execvp(opt->command[0], opt->command);
+		// This goes down the stderr pipe and is stamped like any
+		// other output of the command.
+		int err = errno;
+		fprintf(stderr, "ts: %s: %s\n", opt->command[0], strerror(err));
+		_exit(err == ENOENT ? 127 : 126);
+	}
+
+	child_pid = pid;
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	for (size_t i = 0; i < NELEMENTS(streams); i++)
+		close(pipes[i][1]);
+
+	if (opt->pty && pty_size_source != -1) {
+		struct sigaction sa_winch = { .sa_handler = resize_pty, .sa_flags = SA_RESTART };
+		sigemptyset(&sa_winch.sa_mask);
+		sigaction(SIGWINCH, &sa_winch, NULL);
+		// Catch up with a resize since open_pty().
+		copy_window_size();
+	}
+
+	stamp_sources(opt, fmt, streams, NELEMENTS(streams), secs, nsecs, monodelta);
+
+	// Closing the pipes early, after a write error, leaves the
+	// child to get SIGPIPE if it writes again.
+	for (size_t i = 0; i < NELEMENTS(streams); i++) {
+		close(pipes[i][0]);
+		line_reader_free(&streams[i].reader);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			return EXIT_FAILURE;
+		}
+	}
+
+	child_pid = 0;
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+
+	return WEXITSTATUS(status);
+}
+
+// Generates lines from a synthetic family (--generate) and stamps
+// them as if they had been read. Lines are paced against absolute
+// deadlines on CLOCK_MONOTONIC, so time spent generating and writing
+// does not accumulate as drift; if output falls behind, lines are
+// written back to back until the schedule is met again. Each line
+// embeds the time at which it was generated. buf must have room for
+// the longest line plus GEN_HEADROOM.
+static void generate_lines(const struct ts_opt *opt, struct ts_fmt *fmt, char *buf, size_t bufsz, long *secs, long *nsecs, long monodelta)
+{
+	const struct gen_opt *gen = &opt->gen;
+	struct gen_state st = {
+		.rng = gen->seed,
+		.len_min = gen->len_min,
+		.len_max = gen->len_max,
+	};
+	// Kept apart so that the lines for a given seed do not depend
+	// on the rate profile.
+	struct gen_state pacing = { .rng = ~gen->seed };
+	struct stamp_source out = { .out = stdout };
+	struct timespec now;
+
+	if (read_clock(CLOCK_MONOTONIC, &now, false) != 0) {
+		perror("clock_gettime");
+		return;
+	}
+
+	int64_t start = timespec_to_ns(&now);
+	double period = gen->rate > 0 ? NANOSECONDS_PER_SECOND / gen->rate : 0;
+	double offset = 0;
+
+	for (unsigned long long i = 0; !signal_received && (gen->count == 0 || i < gen->count); i++) {
+		if (gen->duration != 0) {
+			int64_t elapsed = (int64_t)offset;
+			if (period == 0) {
+				if (read_clock(CLOCK_MONOTONIC, &now, false) != 0) {
+					perror("clock_gettime");
+					break;
+				}
+				elapsed = timespec_to_ns(&now) - start;
+			}
+			if (elapsed >= gen->duration)
+				break;
+		}
+
+		if (period > 0 && sleep_until(start + (int64_t)offset, &signal_received) != 0) {
+			if (errno != EINTR)
+				perror("clock_nanosleep");
+			break;
+		}
+
+		if (read_clock(CLOCK_REALTIME, &now, false) != 0) {
+			perror("clock_gettime");
+			break;
+		}
+
+		st.sec = now.tv_sec;
+		st.nsec = now.tv_nsec;
+
+		size_t n = gen->family->fn(&st, gen->family, buf, bufsz);
+
+		if (!stamp_line(opt, fmt, &out, buf, n, secs, nsecs, monodelta))
+			break;
+
+		switch (gen->profile) {
+		case GEN_CONSTANT:
+			offset += period;
+			break;
+		case GEN_POISSON:
+			// Exponentially distributed gaps; u is uniform
+			// in [0, 1).
+			offset += -log1p(-((gen_rand(&pacing) >> 11) * 0x1.0p-53)) * period;
+			break;
+		case GEN_BURST:
+			// Bursts at line rate, spaced to keep the
+			// average at gen->rate.
+			if ((i + 1) % gen->burst == 0)
+				offset += period * gen->burst;
+			break;
+		}
+
+		ALLOC_CHECK_LINE();
+	}
+}
+
+// Writes previously timestamped input back out with its original
+// timing (--replay): each line is held back until as much time has
+// passed since the first timestamped line as separates their
+// embedded timestamps, divided by speed. Lines without a recognised
+// timestamp, or whose timestamp is earlier than the one before, are
+// written straight away. Lines are not stamped again.
+static void replay(struct line_reader *reader, double speed)
+{
+	bool have_base = false;
+	int64_t base_log = 0;
+	int64_t base_clock = 0;
+	int64_t last_log = 0;
+
+	while (!signal_received) {
+		char *line;
+		ssize_t line_len = read_line(reader, &line, &signal_received);
+
+		if (line_len == 0)
+			break;
+
+		if (line_len == -1) {
+			if (errno != EINTR)
+				perror("read");
+			break;
+		}
+
+		struct timespec now;
+		struct tm parsed_tm;
+		struct timespec parsed;
+		size_t match_end;
+
+		if (!reader->continuation &&
+		    read_clock(CLOCK_REALTIME, &now, false) == 0 &&
+		    parse_timestamp(line, line_len, now.tv_sec, &parsed_tm, &parsed, &match_end)) {
+			int64_t t = timespec_to_ns(&parsed);
+
+			if (!have_base) {
+				if (read_clock(CLOCK_MONOTONIC, &now, false) != 0) {
+					perror("clock_gettime");
+					break;
+				}
+				base_log = last_log = t;
+				base_clock = timespec_to_ns(&now);
+				have_base = true;
+			} else if (t > last_log) {
+				last_log = t;
+				if (sleep_until(base_clock + (int64_t)((t - base_log) / speed), &signal_received) != 0) {
+					if (errno != EINTR)
+						perror("clock_nanosleep");
+					break;
+				}
+			}
+		}
+
+		if (fwrite(line, 1, line_len, stdout) != (size_t)line_len) {
+			perror("write");
+			break;
+		}
+	}
+}
+
+// A line held back by --reorder.
+struct reorder_entry {
+	int64_t key;		// Embedded time, in ns.
+	int64_t deadline;	// Monotonic time by which it is written.
+	uint64_t seq;		// Arrival order, to break ties.
+	size_t off;		// Where the line is in the arena.
+	size_t len;
+	bool released;
+};
+
+// Lines are copied into a circular arena in the order they arrive
+// and are written in key order from a min-heap. Lines are only
+// slightly out of order, so the space of the oldest one is usually
+// soon free again; when the arena (or the entry ring) is full, lines
+// are written early until the oldest one has gone.
+struct reorder {
+	char *arena;
+	size_t arena_size;
+	size_t head;			// Where the next line goes.
+	struct reorder_entry *entries;	// Ring, in arrival order.
+	size_t max_entries;
+	size_t first;			// Oldest entry still in the arena.
+	size_t nentries;
+	size_t *heap;			// Unwritten entries, by key.
+	size_t nheap;
+	uint64_t seq;
+	int64_t prev_key;		// Of the last line read.
+	int64_t last_key;		// Of the last line written.
+	int64_t max_key;
+	unsigned long long late;
+};
+
+static bool reorder_before(const struct reorder *ro, size_t a, size_t b)
+{
+	const struct reorder_entry *x = &ro->entries[a];
+	const struct reorder_entry *y = &ro->entries[b];
+
+	return x->key < y->key || (x->key == y->key && x->seq < y->seq);
+}
+
+static void reorder_sift_down(struct reorder *ro, size_t i)
+{
+	for (;;) {
+		size_t min = i;
+		size_t left = 2 * i + 1;
+		size_t right = left + 1;
+
+		if (left < ro->nheap && reorder_before(ro, ro->heap[left], ro->heap[min]))
+			min = left;
+		if (right < ro->nheap && reorder_before(ro, ro->heap[right], ro->heap[min]))
+			min = right;
+		if (min == i)
+			return;
+
+		size_t tmp = ro->heap[i];
+		ro->heap[i] = ro->heap[min];
+		ro->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void reorder_sift_up(struct reorder *ro, size_t i)
+{
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (!reorder_before(ro, ro->heap[i], ro->heap[parent]))
+			return;
+
+		size_t tmp = ro->heap[i];
+		ro->heap[i] = ro->heap[parent];
+		ro->heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static bool reorder_write(struct reorder *ro, const char *line, size_t len, int64_t key)
+{
+	ro->last_key = key;
+
+	if (fwrite(line, 1, len, stdout) != len) {
+		perror("write");
+		return false;
+	}
+
+	return true;
+}
+
+// Writes the line with the earliest key and frees whatever space at
+// the front of the arena that releases.
+static bool reorder_pop(struct reorder *ro)
+{
+	struct reorder_entry *e = &ro->entries[ro->heap[0]];
+
+	ro->heap[0] = ro->heap[--ro->nheap];
+	reorder_sift_down(ro, 0);
+	e->released = true;
+
+	if (!reorder_write(ro, ro->arena + e->off, e->len, e->key))
+		return false;
+
+	while (ro->nentries > 0 && ro->entries[ro->first].released) {
+		ro->first = (ro->first + 1) % ro->max_entries;
+		ro->nentries--;
+	}
+
+	if (ro->nentries == 0)
+		ro->head = 0;
+
+	return true;
+}
+
+// Writes lines in key order until the oldest one has been written.
+static bool reorder_release_first(struct reorder *ro)
+{
+	uint64_t seq = ro->entries[ro->first].seq;
+
+	while (ro->nentries > 0 && ro->entries[ro->first].seq == seq) {
+		if (!reorder_pop(ro))
+			return false;
+	}
+
+	return true;
+}
+
+// Returns where a line of len bytes fits in the arena, or SIZE_MAX if
+// it does not.
+static size_t reorder_alloc(const struct reorder *ro, size_t len)
+{
+	if (ro->nentries == 0)
+		return len <= ro->arena_size ? 0 : SIZE_MAX;
+
+	if (ro->nentries == ro->max_entries)
+		return SIZE_MAX;
+
+	size_t tail = ro->entries[ro->first].off;
+
+	if (ro->head > tail) {
+		if (ro->head + len <= ro->arena_size)
+			return ro->head;
+		return len <= tail ? 0 : SIZE_MAX;
+	}
+
+	return ro->head + len <= tail ? ro->head : SIZE_MAX;
+}
+
+// Takes in one line that arrived at the monotonic time now.
+static bool reorder_add(const struct ts_opt *opt, struct reorder *ro, const struct line_reader *reader, char *line, size_t len, int64_t now)
+{
+	struct timespec realtime;
+	struct tm parsed_tm;
+	struct timespec parsed;
+	size_t match_end;
+	int64_t key = ro->prev_key;
+
+	if (read_clock(CLOCK_REALTIME, &realtime, false) != 0) {
+		perror("clock_gettime");
+		return false;
+	}
+
+	// Continuation lines keep the time of the line before them;
+	// before the first timestamp, lines sort by arrival.
+	if (!reader->continuation && parse_timestamp(line, len, realtime.tv_sec, &parsed_tm, &parsed, &match_end))
+		key = timespec_to_ns(&parsed);
+	else if (key == INT64_MIN)
+		key = timespec_to_ns(&realtime);
+
+	ro->prev_key = key;
+
+	if (key < ro->last_key) {
+		ro->late++;
+		return reorder_write(ro, line, len, ro->last_key);
+	}
+
+	if (key > ro->max_key)
+		ro->max_key = key;
+
+	if (len > ro->arena_size) {
+		while (ro->nheap > 0) {
+			if (!reorder_pop(ro))
+				return false;
+		}
+		return reorder_write(ro, line, len, key);
+	}
+
+	size_t off;
+	while ((off = reorder_alloc(ro, len)) == SIZE_MAX) {
+		if (!reorder_release_first(ro))
+			return false;
+	}
+
+	size_t slot = (ro->first + ro->nentries++) % ro->max_entries;
+	ro->entries[slot] = (struct reorder_entry){
+		.key = key,
+		.deadline = now + opt->reorder_window,
+		.seq = ro->seq++,
+		.off = off,
+		.len = len,
+	};
+	memcpy(ro->arena + off, line, len);
+	ro->head = off + len;
+
+	ro->heap[ro->nheap++] = slot;
+	reorder_sift_up(ro, ro->nheap - 1);
+
+	return true;
+}
+
+// Writes the lines that are due: every line that has been held for
+// the window and, ordering by embedded time, every line at least a
+// window older than the newest one seen.
+static bool reorder_release(const struct ts_opt *opt, struct reorder *ro, int64_t now)
+{
+	while (ro->nentries > 0 && ro->entries[ro->first].deadline <= now) {
+		if (!reorder_release_first(ro))
+			return false;
+	}
+
+	if (opt->reorder_by_arrival)
+		return true;
+
+	while (ro->nheap > 0 && ro->entries[ro->heap[0]].key <= ro->max_key - opt->reorder_window) {
+		if (!reorder_pop(ro))
+			return false;
+	}
+
+	return true;
+}
+
+// Puts slightly out-of-order input back in order by its embedded
+// timestamps (--reorder). A line is held until a line a window newer
+// has been read or, by arrival time, until it has been held for the
+// window, whichever comes first, so lines are never more than the
+// window late; --reorder-buffer bounds the memory, and lines are
+// written early when it is full. A line older than one already
+// written cannot be put back in order: it is written straight away
+// and counted as late.
+static void reorder_lines(const struct ts_opt *opt, struct line_reader *reader)
+{
+	struct reorder ro = {
+		.arena_size = opt->reorder_buffer,
+		.max_entries = opt->reorder_buffer / 32 + 1,
+		.prev_key = INT64_MIN,
+		.last_key = INT64_MIN,
+		.max_key = INT64_MIN,
+	};
+	struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+	struct timespec now;
+
+	ro.arena = malloc(ro.arena_size);
+	ro.entries = calloc(ro.max_entries, sizeof(*ro.entries));
+	ro.heap = calloc(ro.max_entries, sizeof(*ro.heap));
+	if (ro.arena == NULL || ro.entries == NULL || ro.heap == NULL) {
+		perror("reorder buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!signal_received) {
+		char *line;
+		ssize_t len;
+
+		while ((len = next_buffered_line(reader, &line)) > 0) {
+			if (read_clock(CLOCK_MONOTONIC, &now, true) != 0) {
+				perror("clock_gettime");
+				goto out;
+			}
+			if (!reorder_add(opt, &ro, reader, line, len, timespec_to_ns(&now)))
+				goto out;
+			ALLOC_CHECK_LINE();
+		}
+
+		if (reader->eof)
+			break;
+
+		if (read_clock(CLOCK_MONOTONIC, &now, false) != 0) {
+			perror("clock_gettime");
+			break;
+		}
+
+		if (!reorder_release(opt, &ro, timespec_to_ns(&now)))
+			goto out;
+
+		// Wait for input, or until the oldest line is due. The
+		// fake clock only moves as lines arrive.
+		int timeout = -1;
+		if (ro.nentries > 0 && !fake_clock.enabled) {
+			int64_t wait = ro.entries[ro.first].deadline - timespec_to_ns(&now);
+			timeout = wait / 1000000 + 1;
+		}
+
+		int n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		if (n > 0 && fill_line_buffer(reader) < 0 && errno != EINTR && errno != EAGAIN) {
+			perror("read");
+			break;
+		}
+	}
+
+	while (ro.nheap > 0) {
+		if (!reorder_pop(&ro))
+			break;
+	}
+
+out:
+	ALLOC_CHECK_STOP();
+
+	if (ro.late > 0)
+		fprintf(stderr, "ts: %llu line%s arrived too late to reorder.\n", ro.late, ro.late == 1 ? "" : "s");
+
+	free(ro.arena);
+	free(ro.entries);
+	free(ro.heap);
+}
+
+// Returns the offset of the first line that starts at or after off;
+// base is taken to start a line.
+static size_t range_line_start(const char *map, size_t base, size_t size, size_t off)
+{
+	if (off <= base)
+		return base;
+
+	const char *nl = memchr(map + off - 1, '\n', size - off + 1);
+	return nl != NULL ? (size_t)(nl - map) + 1 : size;
+}
+
+// Returns the offset of the first line at or after off with a
+// recognised timestamp, and sets *t to it, or returns size if there
+// is none. The map is private and writable because parse_timestamp()
+// NUL-terminates in place; a last line without a newline is copied
+// out first, as the byte past it may not be mapped.
+static size_t range_next_stamped(char *map, size_t size, size_t off, time_t now, int64_t *t)
+{
+	char last[MAX_TIME_BUFSZ];
+
+	while (off < size) {
+		char *line = map + off;
+		char *nl = memchr(line, '\n', size - off);
+		size_t len = nl != NULL ? (size_t)(nl - line) + 1 : size - off;
+		size_t parse_len = len;
+		struct tm parsed_tm;
+		struct timespec parsed;
+		size_t match_end;
+
+		if (nl == NULL) {
+			parse_len = len < sizeof(last) ? len : sizeof(last) - 1;
+			memcpy(last, line, parse_len);
+			line = last;
+		}
+
+		if (parse_timestamp(line, parse_len, now, &parsed_tm, &parsed, &match_end)) {
+			*t = timespec_to_ns(&parsed);
+			return off;
+		}
+
+		off += len;
+	}
+
+	return size;
+}
+
+// Returns the offset of the first timestamped line whose time is not
+// before bound, or size. Each probe lands on the line after a byte
+// offset and skips forward to the next timestamped line, so lines
+// without a timestamp stay with the line before them.
+static size_t range_search(char *map, size_t base, size_t size, time_t now, int64_t bound)
+{
+	size_t lo = base;
+	size_t hi = size;
+	int64_t t;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t off = range_next_stamped(map, size, range_line_start(map, base, size, mid), now, &t);
+
+		if (off < size && t < bound)
+			lo = off + 1;
+		else
+			hi = mid;
+	}
+
+	return range_next_stamped(map, size, range_line_start(map, base, size, lo), now, &t);
+}
+
+// Writes the lines of a time-ordered input whose timestamps are in
+// [--from, --to); lines without a timestamp go with the line before
+// them. A regular file is mapped and binary-searched for both ends,
+// so only O(log n) lines are parsed and only the range is read.
+// Anything else is read line by line up to the first line at or past
+// --to.
+static void extract_range(const struct ts_opt *opt, struct line_reader *reader)
+{
+	struct timespec now;
+	struct stat st;
+	off_t base;
+
+	if (read_clock(CLOCK_REALTIME, &now, false) != 0) {
+		perror("clock_gettime");
+		return;
+	}
+
+	if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size <= SIZE_MAX && (base = lseek(reader->fd, 0, SEEK_CUR)) >= 0 && base < st.st_size) {
+		size_t size = st.st_size;
+		char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, 0);
+
+		if (map != MAP_FAILED) {
+			posix_madvise(map, size, POSIX_MADV_RANDOM);
+
+			size_t start = opt->range_from == INT64_MIN ? (size_t)base : range_search(map, base, size, now.tv_sec, opt->range_from);
+			size_t end = opt->range_to == INT64_MAX ? size : range_search(map, start, size, now.tv_sec, opt->range_to);
+
+			if (end > start) {
+				posix_madvise(map + start, end - start, POSIX_MADV_SEQUENTIAL);
+				if (fwrite(map + start, 1, end - start, stdout) != end - start)
+					perror("write");
+			}
+
+			munmap(map, size);
+			return;
+		}
+	}
+
+	int64_t t = INT64_MIN;
+
+	while (!signal_received) {
+		char *line;
+		ssize_t line_len = read_line(reader, &line, &signal_received);
+		struct tm parsed_tm;
+		struct timespec parsed;
+		size_t match_end;
+
+		if (line_len == 0)
+			break;
+
+		if (line_len == -1) {
+			if (errno != EINTR)
+				perror("read");
+			break;
+		}
+
+		if (!reader->continuation && parse_timestamp(line, line_len, now.tv_sec, &parsed_tm, &parsed, &match_end)) {
+			t = timespec_to_ns(&parsed);
+			if (t >= opt->range_to)
+				break;
+		}
+
+		if (t >= opt->range_from && fwrite(line, 1, line_len, stdout) != (size_t)line_len) {
+			perror("write");
+			break;
+		}
+	}
+}
+
+// Capture archive (--archive, --query).
+//
+// The file starts with ARCHIVE_MAGIC and a little-endian 32-bit
+// version, then holds a sequence of self-contained blocks, each
+// written with a single write(2) so that a crash can only ever lose,
+// or leave a torn copy of, the last one:
+//
+//   0  "TSB1"
+//   4  u32 number of lines
+//   8  i64 earliest time   } the sparse time index: whole blocks
+//  16  i64 latest time     } outside a query's range are skipped
+//  24  i64 base time
+//  32  u32 size of the time column
+//  36  u32 size of the length column
+//  40  u32 size of the text
+//  44  u32 CRC-32 of the text
+//  48  u32 CRC-32 of bytes 0-47 and both columns
+//
+// followed by the time column (zigzag varint deltas in nanoseconds,
+// the first from the base time), the length column (varint length of
+// each line) and the text (the lines, back to back). Times and counts
+// are answered from the columns alone; the text is read only for the
+// blocks whose lines are written out.
+#define ARCHIVE_MAGIC "TSARCHIV"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER 16
+#define BLOCK_MAGIC "TSB1"
+#define BLOCK_HEADER 52
+
+#ifndef ARCHIVE_BLOCK_LINES
+#define ARCHIVE_BLOCK_LINES 4096
+#endif
+
+#ifndef ARCHIVE_BLOCK_BYTES
+#define ARCHIVE_BLOCK_BYTES (1024 * 1024)
+#endif
+
+struct archive_block {
+	uint32_t nlines;
+	int64_t min_ns;
+	int64_t max_ns;
+	int64_t base_ns;
+	uint32_t time_bytes;
+	uint32_t len_bytes;
+	uint32_t text_bytes;
+	uint32_t text_crc;
+	uint32_t meta_crc;
+};
+
+struct archive_writer {
+	int fd;
+	struct archive_block block;
+	int64_t prev_ns;
+	unsigned char header[BLOCK_HEADER];
+	unsigned char *times;		// ARCHIVE_BLOCK_LINES varints.
+	unsigned char *lens;
+	char *text;			// ARCHIVE_BLOCK_BYTES.
+};
+
+static void archive_encode_header(const struct archive_block *b, unsigned char *p)
+{
+	memcpy(p, BLOCK_MAGIC, 4);
+	put_le32(p + 4, b->nlines);
+	put_le64(p + 8, b->min_ns);
+	put_le64(p + 16, b->max_ns);
+	put_le64(p + 24, b->base_ns);
+	put_le32(p + 32, b->time_bytes);
+	put_le32(p + 36, b->len_bytes);
+	put_le32(p + 40, b->text_bytes);
+	put_le32(p + 44, b->text_crc);
+	put_le32(p + 48, b->meta_crc);
+}
+
+static bool archive_decode_header(const unsigned char *p, struct archive_block *b)
+{
+	if (memcmp(p, BLOCK_MAGIC, 4) != 0)
+		return false;
+
+	b->nlines = get_le32(p + 4);
+	b->min_ns = get_le64(p + 8);
+	b->max_ns = get_le64(p + 16);
+	b->base_ns = get_le64(p + 24);
+	b->time_bytes = get_le32(p + 32);
+	b->len_bytes = get_le32(p + 36);
+	b->text_bytes = get_le32(p + 40);
+	b->text_crc = get_le32(p + 44);
+	b->meta_crc = get_le32(p + 48);
+	return true;
+}
+
+// Appends the pending block, whose text is at text, in one write.
+static bool archive_flush(struct archive_writer *w, const char *text)
+{
+	struct archive_block *b = &w->block;
+
+	if (b->nlines == 0)
+		return true;
+
+	b->text_crc = crc32_update(0, text, b->text_bytes);
+	archive_encode_header(b, w->header);
+	b->meta_crc = crc32_update(0, w->header, BLOCK_HEADER - 4);
+	b->meta_crc = crc32_update(b->meta_crc, w->times, b->time_bytes);
+	b->meta_crc = crc32_update(b->meta_crc, w->lens, b->len_bytes);
+	put_le32(w->header + BLOCK_HEADER - 4, b->meta_crc);
+
+	struct iovec iov[] = {
+		{ w->header, BLOCK_HEADER },
+		{ w->times, b->time_bytes },
+		{ w->lens, b->len_bytes },
+		{ (char *)text, b->text_bytes },
+	};
+	size_t total = BLOCK_HEADER + b->time_bytes + b->len_bytes + b->text_bytes;
+	ssize_t n;
+
+	while ((n = writev(w->fd, iov, NELEMENTS(iov))) < 0 && errno == EINTR)
+		;
+
+	// A short write leaves a torn block; complete it so that
+	// what follows is not misread.
+	if (n >= 0 && (size_t)n < total) {
+		for (size_t i = 0, skip = n; i < NELEMENTS(iov); i++) {
+			if (skip >= iov[i].iov_len) {
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			if (!write_all(w->fd, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip))
+				return false;
+			skip = 0;
+		}
+	}
+
+	*b = (struct archive_block){ 0 };
+	return n >= 0;
+}
+
+static bool archive_add(struct archive_writer *w, const char *line, size_t len, int64_t ns)
+{
+	struct archive_block *b = &w->block;
+
+	if (len > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
+
+	if (b->nlines == ARCHIVE_BLOCK_LINES || b->text_bytes + len > ARCHIVE_BLOCK_BYTES) {
+		if (!archive_flush(w, w->text))
+			return false;
+	}
+
+	if (b->nlines == 0) {
+		b->min_ns = b->max_ns = b->base_ns = w->prev_ns = ns;
+	}
+
+	b->time_bytes += put_varint(w->times + b->time_bytes, zigzag(ns - w->prev_ns));
+	b->len_bytes += put_varint(w->lens + b->len_bytes, len);
+	b->nlines++;
+	w->prev_ns = ns;
+	if (ns < b->min_ns)
+		b->min_ns = ns;
+	if (ns > b->max_ns)
+		b->max_ns = ns;
+
+	// A line that does not fit a block gets a block of its own,
+	// written from where it is.
+	if (len > ARCHIVE_BLOCK_BYTES) {
+		b->text_bytes = len;
+		return archive_flush(w, line);
+	}
+
+	memcpy(w->text + b->text_bytes, line, len);
+	b->text_bytes += len;
+	return true;
+}
+
+static bool archive_check(int fd, off_t size)
+{
+	unsigned char header[ARCHIVE_HEADER];
+
+	return size >= ARCHIVE_HEADER && pread(fd, header, ARCHIVE_HEADER, 0) == ARCHIVE_HEADER &&
+		memcmp(header, ARCHIVE_MAGIC, 8) == 0 && get_le32(header + 8) == ARCHIVE_VERSION;
+}
+
+// Returns the offset just past the last complete block of the archive
+// open on fd, which is size bytes long, or -1 if it is not an archive.
+static off_t archive_scan(int fd, off_t size)
+{
+	unsigned char header[BLOCK_HEADER];
+	struct archive_block b;
+	off_t off = ARCHIVE_HEADER;
+
+	if (!archive_check(fd, size))
+		return -1;
+
+	while (off + BLOCK_HEADER <= size && pread(fd, header, BLOCK_HEADER, off) == BLOCK_HEADER &&
+	       archive_decode_header(header, &b)) {
+		off_t end = off + BLOCK_HEADER + (off_t)b.time_bytes + b.len_bytes + b.text_bytes;
+		if (end > size)
+			break;
+		off = end;
+	}
+
+	return off;
+}
+
+// Opens path for appending, creating it if need be. An incomplete
+// block left at the end by a crash is cut off first.
+static int archive_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+	struct stat st;
+	unsigned char header[ARCHIVE_HEADER] = ARCHIVE_MAGIC;
+
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error: %s: %s.\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size == 0) {
+		put_le32(header + 8, ARCHIVE_VERSION);
+		if (!write_all(fd, header, sizeof(header))) {
+			fprintf(stderr, "Error: %s: %s.\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		return fd;
+	}
+
+	off_t end = archive_scan(fd, st.st_size);
+	if (end < 0) {
+		fprintf(stderr, "Error: %s: not a ts archive.\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (end < st.st_size) {
+		fprintf(stderr, "ts: %s: discarding %lld bytes of an incomplete block.\n", path, (long long)(st.st_size - end));
+		if (ftruncate(fd, end) != 0) {
+			fprintf(stderr, "Error: %s: %s.\n", path, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	return fd;
+}
+
+// Stamps each line of input with the time it was read, to the
+// nanosecond, and appends both to the archive (--archive) rather than
+// writing text. Blocks are written as they fill and at the end of
+// input.
+static void archive_lines(const struct ts_opt *opt, struct line_reader *reader)
+{
+	struct archive_writer w = { .fd = archive_open(opt->archive) };
+
+	w.times = malloc(ARCHIVE_BLOCK_LINES * VARINT_MAX);
+	w.lens = malloc(ARCHIVE_BLOCK_LINES * VARINT_MAX);
+	w.text = malloc(ARCHIVE_BLOCK_BYTES);
+	if (w.times == NULL || w.lens == NULL || w.text == NULL) {
+		perror("archive buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!signal_received) {
+		char *line;
+		ssize_t line_len = read_line(reader, &line, &signal_received);
+		struct timespec now;
+
+		if (line_len == 0)
+			break;
+
+		if (line_len == -1) {
+			if (errno != EINTR)
+				perror("read");
+			break;
+		}
+
+		if (read_clock(CLOCK_REALTIME, &now, true) != 0) {
+			perror("clock_gettime");
+			break;
+		}
+
+		if (!archive_add(&w, line, line_len, timespec_to_ns(&now))) {
+			perror("write");
+			break;
+		}
+
+		ALLOC_CHECK_LINE();
+	}
+
+	ALLOC_CHECK_STOP();
+
+	if (!archive_flush(&w, w.text) || close(w.fd) != 0)
+		perror("write");
+
+	free(w.times);
+	free(w.lens);
+	free(w.text);
+}
+
+static bool grow_buffer(unsigned char **buf, size_t *bufsz, size_t need)
+{
+	if (need <= *bufsz)
+		return true;
+
+	unsigned char *p = realloc(*buf, need);
+	if (p == NULL)
+		return false;
+
+	*buf = p;
+	*bufsz = need;
+	return true;
+}
+
+// Answers a query against the archive (--query): writes the lines
+// stamped in [--from, --to), each with its time in the format given,
+// or with --count-per, the number of such lines in each interval that
+// has any. Blocks outside the range are skipped on their header, and
+// counting reads only the time column. A block whose checksum does
+// not match is reported and skipped, and so is an incomplete block at
+// the end. Returns false if a block was corrupt or on error.
+static bool query_archive(const struct ts_opt *opt, struct ts_fmt *fmt)
+{
+	int fd = open(opt->query, O_RDONLY);
+	unsigned char header[BLOCK_HEADER];
+	unsigned char *meta = NULL;
+	unsigned char *text = NULL;
+	size_t meta_sz = 0;
+	size_t text_sz = 0;
+	struct stat st;
+	int64_t bucket = INT64_MIN;
+	unsigned long long count = 0;
+	off_t end = ARCHIVE_HEADER;	// Of the last complete block.
+	bool ok = true;
+
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error: %s: %s.\n", opt->query, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (!archive_check(fd, st.st_size)) {
+		fprintf(stderr, "Error: %s: not a ts archive.\n", opt->query);
+		exit(EXIT_FAILURE);
+	}
+
+	// An incomplete last block (still being written, or torn by a
+	// crash) ends the archive.
+	for (off_t off = ARCHIVE_HEADER; off + BLOCK_HEADER <= st.st_size && !signal_received;) {
+		struct archive_block b;
+
+		if (pread(fd, header, BLOCK_HEADER, off) != BLOCK_HEADER || !archive_decode_header(header, &b))
+			break;
+
+		off_t block_off = off;
+		size_t meta_bytes = (size_t)b.time_bytes + b.len_bytes;
+		off += BLOCK_HEADER + meta_bytes + b.text_bytes;
+		if (off > st.st_size)
+			break;
+		end = off;
+
+		if (b.max_ns < opt->range_from || b.min_ns >= opt->range_to)
+			continue;
+
+		if (!grow_buffer(&meta, &meta_sz, meta_bytes) ||
+		    pread(fd, meta, meta_bytes, block_off + BLOCK_HEADER) != (ssize_t)meta_bytes) {
+			perror("read");
+			ok = false;
+			goto out;
+		}
+
+		uint32_t crc = crc32_update(0, header, BLOCK_HEADER - 4);
+		if (crc32_update(crc, meta, meta_bytes) != b.meta_crc) {
+			fprintf(stderr, "ts: %s: skipping corrupt block at offset %lld.\n", opt->query, (long long)block_off);
+			ok = false;
+			continue;
+		}
+
+		if (opt->count_per == 0) {
+			if (!grow_buffer(&text, &text_sz, b.text_bytes) ||
+			    pread(fd, text, b.text_bytes, block_off + BLOCK_HEADER + meta_bytes) != (ssize_t)b.text_bytes) {
+				perror("read");
+				ok = false;
+				goto out;
+			}
+			if (crc32_update(0, text, b.text_bytes) != b.text_crc) {
+				fprintf(stderr, "ts: %s: skipping corrupt block at offset %lld.\n", opt->query, (long long)block_off);
+				ok = false;
+				continue;
+			}
+		}
+
+		const unsigned char *tp = meta;
+		const unsigned char *lp = meta + b.time_bytes;
+		size_t text_off = 0;
+		int64_t ns = b.base_ns;
+
+		for (uint32_t i = 0; i < b.nlines; i++) {
+			uint64_t delta, len;
+
+			if (!get_varint(&tp, meta + b.time_bytes, &delta) ||
+			    !get_varint(&lp, meta + meta_bytes, &len) || len > b.text_bytes - text_off)
+				break;
+
+			ns += unzigzag(delta);
+			text_off += len;
+
+			if (ns < opt->range_from || ns >= opt->range_to)
+				continue;
+
+			if (opt->count_per != 0) {
+				int64_t t = ns - (ns % opt->count_per + opt->count_per) % opt->count_per;
+				if (t != bucket && count > 0) {
+					fmt_time_now(fmt, ns_to_timespec(bucket));
+					printf("%s %llu\n", fmt->buf, count);
+					count = 0;
+				}
+				bucket = t;
+				count++;
+				continue;
+			}
+
+			fmt_time_now(fmt, ns_to_timespec(ns));
+			if (fputs(fmt->buf, stdout) == EOF || putc(' ', stdout) == EOF ||
+			    fwrite(text + text_off - len, 1, len, stdout) != len) {
+				perror("write");
+				ok = false;
+				goto out;
+			}
+		}
+	}
+
+	if (count > 0) {
+		fmt_time_now(fmt, ns_to_timespec(bucket));
+		printf("%s %llu\n", fmt->buf, count);
+	}
+
+	if (end < st.st_size && !signal_received)
+		fprintf(stderr, "ts: %s: ignoring %lld bytes of an incomplete block.\n",
+			opt->query, (long long)(st.st_size - end));
+
+out:
+	free(meta);
+	free(text);
+	close(fd);
+	return ok;
+}
+
+static bool read_varint(FILE *in, uint64_t *v)
+{
+	*v = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = getc(in);
+		if (c == EOF)
+			return false;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+// Turns a stream of --binary records on stdin back into text
+// (--decode): each line prefixed with its time in the format given,
+// then its source id if the records have one. The pieces of a split
+// line are joined up again. Returns false if the stream is truncated
+// or cannot be written.
+static bool decode_records(struct ts_fmt *fmt)
+{
+	unsigned char header[BINARY_HEADER];
+	char *line = NULL;
+	size_t bufsz = 0;
+
+	if (fread(header, 1, sizeof(header), stdin) != sizeof(header) ||
+	    memcmp(header, BINARY_MAGIC, 6) != 0 || header[6] != BINARY_VERSION) {
+		fprintf(stderr, "Error: input is not a stream of ts records.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned fields = header[7];
+	bool ok = true;
+
+	while (!signal_received) {
+		unsigned char ns[8];
+		uint64_t len, source = 0, seq;
+		int c = getc(stdin);
+
+		if (c == EOF)
+			break;
+		ungetc(c, stdin);
+
+		if (!read_varint(stdin, &len) || fread(ns, 1, sizeof(ns), stdin) != sizeof(ns) ||
+		    ((fields & BINARY_SOURCE) && !read_varint(stdin, &source)) ||
+		    ((fields & BINARY_SEQ) && !read_varint(stdin, &seq))) {
+			fprintf(stderr, "Error: truncated record.\n");
+			ok = false;
+			break;
+		}
+
+		bool continues = len & 1;
+		len >>= 1;
+
+		if (len > bufsz) {
+			char *p = realloc(line, len);
+			if (p == NULL) {
+				perror("realloc");
+				ok = false;
+				break;
+			}
+			line = p;
+			bufsz = len;
+		}
+
+		if (fread(line, 1, len, stdin) != len) {
+			fprintf(stderr, "Error: truncated record.\n");
+			ok = false;
+			break;
+		}
+
+		if (!continues) {
+			fmt_time_now(fmt, ns_to_timespec((int64_t)get_le64(ns)));
+			if (fputs(fmt->buf, stdout) == EOF || putc(' ', stdout) == EOF ||
+			    ((fields & BINARY_SOURCE) && printf("%llu ", (unsigned long long)source) < 0)) {
+				perror("write");
+				ok = false;
+				break;
+			}
+		}
+		if (fwrite(line, 1, len, stdout) != len) {
+			perror("write");
+			ok = false;
+			break;
+		}
+	}
+
+	free(line);
+	return ok;
+}
+
+// --output FILE
+//
+// Stdout becomes a pipe and a thread drains the pipe into the file,
+// so that compression, rotation and reopening all happen off the
+// stamping thread, which only ever writes to the pipe.
+//
+// With --compress the file is a sequence of independent gzip members
+// or zstd frames, both of which the standard tools decompress as one
+// stream. A frame is closed every --frame-size bytes of input and
+// whenever the input has been idle for OUTPUT_IDLE_MS, so a file that
+// is still being written decompresses cleanly up to the last quiet
+// moment.
+//
+// The file is rotated (FILE -> FILE.1 -> ... -> FILE.N) once it
+// reaches --rotate-size or at each multiple of --rotate-interval
+// since the epoch, and reopened on SIGHUP after an external rotation.
+// Both wait for the end of the current line, so lines are never split
+// across files.
+//
+// --preallocate reserves disk space an extent at a time, ahead of the
+// data. On Linux the space is reserved past the end of the file, which
+// keeps its size, so the file is still appended to and a reader never
+// sees the reserved space. Elsewhere posix_fallocate() extends the
+// file with zeros, which are trimmed when the file is closed; if ts
+// was killed before then, they are trimmed when the file is next
+// opened instead.
+//
+// With --mmap the file is allocated OUTPUT_MMAP_WINDOW (or
+// --preallocate) bytes at a time and written through a shared mapping
+// of the current extent. Uncompressed input is read from the pipe
+// straight into the mapping, so the data is copied once, with no
+// write(2) at all. A full window is handed to the syncer thread, which
+// msyncs and unmaps it and drops its pages from the page cache. The
+// file's size covers the whole of the current extent, so until the
+// file is closed a reader sees zeros after the data; the unused tail is
+// trimmed then, which ts also does on SIGINT and SIGTERM, and otherwise
+// by output_recover() when the file is next opened.
+#ifndef OUTPUT_IDLE_MS
+#define OUTPUT_IDLE_MS 1000
+#endif
+
+#define OUTPUT_BUFSZ (128 * 1024)
+#define OUTPUT_MMAP_WINDOW (64 * 1024 * 1024)
+#define OUTPUT_SYNC_QUEUE 4
+
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+#define OUTPUT_KEEP_SIZE 1
+#else
+#define OUTPUT_KEEP_SIZE 0
+#endif
+
+enum output_switch {
+	OUTPUT_KEEP,
+	OUTPUT_REOPEN,
+	OUTPUT_ROTATE,
+};
+
+// A --mmap window waiting to be synced and unmapped.
+struct output_window {
+	unsigned char *map;
+	size_t len;
+	off_t off;
+	int fd;			// A dup, so the file can be closed meanwhile.
+};
+
+struct output_syncer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct output_window queue[OUTPUT_SYNC_QUEUE];
+	size_t head, count;
+	bool done;
+	bool failed;
+};
+
+struct output {
+	const struct ts_opt *opt;
+	int in;			// Read end of the stdout pipe.
+	int fd;
+	pthread_t thread;
+	unsigned char *inbuf;
+	unsigned char *outbuf;
+	size_t frame_bytes;	// Input in the current frame.
+	off_t size;		// Bytes in the file.
+	off_t allocated;	// End of the --preallocate extents.
+	unsigned char *map;	// Current --mmap window, or NULL.
+	off_t map_off;		// Its offset in the file.
+	size_t window;		// Its size.
+	struct output_syncer *syncer;
+	int64_t rotate_at;	// Next --rotate-interval boundary, in ns.
+	bool at_line_start;
+	enum output_switch pending;
+	bool failed;
+#ifdef TS_ZLIB
+	z_stream gz;
+#endif
+#ifdef TS_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+static volatile sig_atomic_t output_reopen;
+static int output_wake[2] = { -1, -1 };	// The SIGHUP pipe.
+
+static void output_hup_handler(int sig)
+{
+	(void)sig;
+	output_reopen = 1;
+	wake_pipe_poke(output_wake);
+}
+
+static void *output_syncer(void *arg)
+{
+	struct output_syncer *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (s->count == 0 && !s->done)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->count == 0)
+			break;
+
+		struct output_window w = s->queue[s->head];
+		s->head = (s->head + 1) % OUTPUT_SYNC_QUEUE;
+		s->count--;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		bool ok = msync(w.map, w.len, MS_SYNC) == 0;
+		if (!ok)
+			perror("msync");
+		munmap(w.map, w.len);
+		// The data is on disk, so keeping it cached only
+		// crowds out pages that are still wanted.
+		posix_fadvise(w.fd, w.off, w.len, POSIX_FADV_DONTNEED);
+		close(w.fd);
+
+		pthread_mutex_lock(&s->lock);
+		s->failed |= !ok;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+// Hands the current window to the syncer, waiting if it is behind.
+static bool output_unmap(struct output *o)
+{
+	struct output_syncer *s = o->syncer;
+	struct output_window w = { o->map, o->window, o->map_off, dup(o->fd) };
+
+	if (o->map == NULL)
+		return true;
+	o->map = NULL;
+
+	if (w.fd < 0) {
+		perror("dup");
+		munmap(w.map, w.len);
+		return false;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while (s->count == OUTPUT_SYNC_QUEUE)
+		pthread_cond_wait(&s->cond, &s->lock);
+	s->queue[(s->head + s->count++) % OUTPUT_SYNC_QUEUE] = w;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return true;
+}
+
+// Reserves the disk space up to end. With --mmap the file has to grow
+// for the space to be mapped; otherwise, where the system allows it,
+// the size is left alone and the space sits past the end of the file.
+static bool output_reserve(struct output *o, off_t end)
+{
+	int rc;
+
+#if OUTPUT_KEEP_SIZE
+	if (!o->opt->mmap) {
+		// Reserving space is only an optimisation.
+		rc = fallocate(o->fd, FALLOC_FL_KEEP_SIZE, o->allocated, end - o->allocated);
+		if (rc != 0 && errno != EOPNOTSUPP) {
+			perror(o->opt->output);
+			return false;
+		}
+		o->allocated = end;
+		return true;
+	}
+#endif
+
+	rc = posix_fallocate(o->fd, o->allocated, end - o->allocated);
+	if (rc != 0) {
+		fprintf(stderr, "Error: %s: %s.\n", o->opt->output, strerror(rc));
+		return false;
+	}
+	o->allocated = end;
+	return true;
+}
+
+// Maps the window that the next byte of the file falls in, allocating
+// it first so that a full disk is an error here rather than a SIGBUS
+// later. Returns the room left in the window, or 0 on error.
+static size_t output_map(struct output *o)
+{
+	if (o->map != NULL && o->size < o->map_off + (off_t)o->window)
+		return o->map_off + o->window - o->size;
+
+	if (!output_unmap(o))
+		return 0;
+
+	off_t off = o->size - o->size % o->window;
+	off_t end = off + o->window;
+	if (end > o->allocated && !output_reserve(o, end))
+		return 0;
+
+	void *map = mmap(NULL, o->window, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, off);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 0;
+	}
+	posix_madvise(map, o->window, POSIX_MADV_SEQUENTIAL);
+
+	o->map = map;
+	o->map_off = off;
+	return end - o->size;
+}
+
+// Appends to the file, reserving space --preallocate bytes at a time.
+// Extents end on multiples of the extent size, for output_recover().
+static bool output_file_write(struct output *o, const void *buf, size_t len)
+{
+	off_t extent = o->opt->preallocate;
+
+	if (o->opt->mmap) {
+		const unsigned char *p = buf;
+		while (len > 0) {
+			size_t n = output_map(o);
+			if (n == 0)
+				return false;
+			if (n > len)
+				n = len;
+			memcpy(o->map + (o->size - o->map_off), p, n);
+			o->size += n;
+			p += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	if (extent > 0 && o->size + (off_t)len > o->allocated &&
+	    !output_reserve(o, ((o->size + (off_t)len) / extent + 1) * extent))
+		return false;
+
+	if (!write_all(o->fd, buf, len)) {
+		perror(o->opt->output);
+		return false;
+	}
+
+	o->size += len;
+	return true;
+}
+
+#ifdef TS_ZLIB
+static bool output_gzip(struct output *o, const unsigned char *data, size_t len, bool end)
+{
+	int rc;
+
+	o->gz.next_in = (unsigned char *)data;
+	o->gz.avail_in = len;
+
+	do {
+		o->gz.next_out = o->outbuf;
+		o->gz.avail_out = OUTPUT_BUFSZ;
+		rc = deflate(&o->gz, end ? Z_FINISH : Z_NO_FLUSH);
+		if (rc == Z_STREAM_ERROR) {
+			fprintf(stderr, "Error: %s: deflate failed.\n", o->opt->output);
+			return false;
+		}
+		if (!output_file_write(o, o->outbuf, OUTPUT_BUFSZ - o->gz.avail_out))
+			return false;
+	} while (end ? rc != Z_STREAM_END : o->gz.avail_out == 0);
+
+	return !end || deflateReset(&o->gz) == Z_OK;
+}
+#endif
+
+#ifdef TS_ZSTD
+static bool output_zstd(struct output *o, const unsigned char *data, size_t len, bool end)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+	size_t rc;
+
+	do {
+		ZSTD_outBuffer out = { o->outbuf, OUTPUT_BUFSZ, 0 };
+		rc = ZSTD_compressStream2(o->zstd, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(rc)) {
+			fprintf(stderr, "Error: %s: %s.\n", o->opt->output, ZSTD_getErrorName(rc));
+			return false;
+		}
+		if (!output_file_write(o, o->outbuf, out.pos))
+			return false;
+	} while (end ? rc != 0 : in.pos < in.size);
+
+	return true;
+}
+#endif
+
+// Compresses len bytes of data, then closes the frame if end is set.
+static bool output_compress(struct output *o, const unsigned char *data, size_t len, bool end)
+{
+	switch (o->opt->compress) {
+#ifdef TS_ZLIB
+	case COMPRESS_GZIP:
+		return output_gzip(o, data, len, end);
+#endif
+#ifdef TS_ZSTD
+	case COMPRESS_ZSTD:
+		return output_zstd(o, data, len, end);
+#endif
+	default:
+		(void)data;
+		(void)len;
+		(void)end;
+		return false;
+	}
+}
+
+static bool output_end_frame(struct output *o)
+{
+	if (o->frame_bytes == 0)
+		return true;
+	o->frame_bytes = 0;
+	return output_compress(o, NULL, 0, true);
+}
+
+// Writes data to the file, compressed if need be.
+static bool output_put(struct output *o, const unsigned char *data, size_t len)
+{
+	if (o->opt->compress == COMPRESS_NONE)
+		return output_file_write(o, data, len);
+
+	while (len > 0) {
+		size_t n = o->opt->frame_size - o->frame_bytes;
+		if (n > len)
+			n = len;
+		if (!output_compress(o, data, n, false))
+			return false;
+		o->frame_bytes += n;
+		data += n;
+		len -= n;
+		if (o->frame_bytes == o->opt->frame_size && !output_end_frame(o))
+			return false;
+	}
+
+	return true;
+}
+
+static int64_t output_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return timespec_to_ns(&now);
+}
+
+static void output_schedule(struct output *o)
+{
+	int64_t interval = o->opt->rotate_interval;
+
+	if (interval > 0)
+		o->rotate_at = (output_now() / interval + 1) * interval;
+}
+
+// Trims the zeros that an extent allocated by an earlier run left past
+// its data, when that run was killed before it could trim them itself;
+// otherwise this run's lines would follow them. Such a file ends on an
+// extent boundary, and its data ends after the last byte that is not
+// zero in the final extent.
+static bool output_recover(struct output *o, off_t extent)
+{
+	off_t start = o->size - extent, end = o->size;
+
+	if (o->size == 0 || o->size % extent != 0)
+		return true;
+
+	while (end > start) {
+		size_t n = end - start < OUTPUT_BUFSZ ? (size_t)(end - start) : OUTPUT_BUFSZ;
+		if (pread(o->fd, o->inbuf, n, end - n) != (ssize_t)n) {
+			perror(o->opt->output);
+			return false;
+		}
+		end -= n;
+		while (n > 0 && o->inbuf[n - 1] == 0)
+			n--;
+		if (n > 0) {
+			end += n;
+			break;
+		}
+	}
+
+	if (end == o->size)
+		return true;
+
+	fprintf(stderr, "ts: %s: discarding %lld bytes of preallocated space.\n",
+		o->opt->output, (long long)(o->size - end));
+	if (ftruncate(o->fd, end) != 0 || lseek(o->fd, end, SEEK_SET) < 0) {
+		perror(o->opt->output);
+		return false;
+	}
+	o->size = end;
+	return true;
+}
+
+static bool output_open_file(struct output *o)
+{
+	// Unless the space for them is kept past the end of the file,
+	// preallocated extents lie past the end of the data, so writes
+	// have to follow the data rather than the end of the file.
+	// A shared mapping has to be readable too, as does a file that
+	// output_recover() may have to read back.
+	bool extends = o->opt->mmap || (o->opt->preallocate && !OUTPUT_KEEP_SIZE);
+	int flags = O_CREAT | O_CLOEXEC | (extends ? O_RDWR : O_WRONLY | O_APPEND);
+
+	if ((o->fd = open(o->opt->output, flags, 0666)) < 0 ||
+	    (o->size = lseek(o->fd, 0, SEEK_END)) < 0) {
+		perror(o->opt->output);
+		return false;
+	}
+
+	off_t extent = o->opt->mmap ? (off_t)o->window : (off_t)o->opt->preallocate;
+	if (extends && !output_recover(o, extent))
+		return false;
+
+	o->allocated = o->size;
+	return true;
+}
+
+// Closes the file, trimming off any preallocated space beyond the
+// data.
+static bool output_close_file(struct output *o)
+{
+	bool ok = true;
+
+	if (o->fd < 0)
+		return true;
+
+	if (!output_unmap(o))
+		ok = false;
+	if (o->allocated > o->size && ftruncate(o->fd, o->size) != 0) {
+		perror(o->opt->output);
+		ok = false;
+	}
+	if (close(o->fd) != 0) {
+		perror(o->opt->output);
+		ok = false;
+	}
+
+	o->fd = -1;
+	return ok;
+}
+
+// Shifts FILE.1 ... FILE.N-1 up by one, dropping FILE.N, and moves
+// FILE to FILE.1; with --rotate-keep 0 FILE is just removed.
+static void output_shift(struct output *o)
+{
+	const char *path = o->opt->output;
+	char from[PATH_MAX], to[PATH_MAX];
+
+	if (o->opt->rotate_keep == 0) {
+		if (unlink(path) != 0 && errno != ENOENT)
+			perror(path);
+		return;
+	}
+
+	for (unsigned i = o->opt->rotate_keep; i > 0; i--) {
+		if (i > 1)
+			snprintf(from, sizeof(from), "%s.%u", path, i - 1);
+		else
+			snprintf(from, sizeof(from), "%s", path);
+		snprintf(to, sizeof(to), "%s.%u", path, i);
+		if (rename(from, to) != 0 && errno != ENOENT)
+			fprintf(stderr, "Error: rename %s to %s: %s.\n", from, to, strerror(errno));
+	}
+}
+
+// Rotates or reopens the file, which must be at a line boundary.
+static bool output_switch(struct output *o)
+{
+	enum output_switch what = o->pending;
+
+	o->pending = OUTPUT_KEEP;
+
+	if (!output_end_frame(o))
+		return false;
+
+	if (what == OUTPUT_ROTATE) {
+		output_schedule(o);
+		if (o->size == 0)
+			return true;
+	}
+
+	if (!output_close_file(o))
+		return false;
+	if (what == OUTPUT_ROTATE)
+		output_shift(o);
+
+	return output_open_file(o);
+}
+
+// Notes whether the file is due to be rotated.
+static void output_check(struct output *o)
+{
+	if (o->pending != OUTPUT_KEEP)
+		return;
+
+	if ((o->opt->rotate_size > 0 && o->size >= (off_t)o->opt->rotate_size) ||
+	    (o->opt->rotate_interval > 0 && output_now() >= o->rotate_at))
+		o->pending = OUTPUT_ROTATE;
+}
+
+// Limits a write of len bytes to what fits under --rotate-size, so
+// that the rotation is due at the first line end past the limit
+// rather than at the end of a whole chunk.
+static size_t output_room(struct output *o, size_t len)
+{
+	off_t room = (off_t)o->opt->rotate_size - o->size;
+
+	if (o->pending != OUTPUT_KEEP || o->opt->rotate_size == 0)
+		return len;
+	if (room <= 0) {
+		o->pending = OUTPUT_ROTATE;
+		return len;
+	}
+
+	return (off_t)len > room ? (size_t)room : len;
+}
+
+static bool output_write(struct output *o, const unsigned char *data, size_t len)
+{
+	while (len > 0) {
+		size_t n = output_room(o, len);
+
+		// Write no further than the end of the line while a
+		// switch is pending.
+		if (o->pending != OUTPUT_KEEP) {
+			const unsigned char *nl = memchr(data, '\n', len);
+			if (nl != NULL)
+				n = nl - data + 1;
+		}
+
+		if (!output_put(o, data, n))
+			return false;
+		o->at_line_start = data[n - 1] == '\n';
+		data += n;
+		len -= n;
+
+		output_check(o);
+		if (o->pending != OUTPUT_KEEP && o->at_line_start && !output_switch(o))
+			return false;
+	}
+
 	return true;
 }
 
-static struct ts_opt parse_options(int argc, char *argv[])
+// How long the thread can wait for input before it has something
+// else to do, in ms, or -1.
+static int output_timeout(const struct output *o)
 {
-	struct ts_opt option = { 0 };
-
-	int opt;
-	char *value_endptr;
-	long value;
+	int timeout = o->frame_bytes > 0 ? OUTPUT_IDLE_MS : -1;
+
+	if (o->opt->rotate_interval > 0 && o->size > 0) {
+		int64_t ms = (o->rotate_at - output_now()) / 1000000 + 1;
+		if (ms < 0)
+			ms = 0;
+		if (timeout < 0 || ms < timeout)
+			timeout = ms < INT_MAX ? ms : INT_MAX;
+	}
 
-	option.flag_precision = 2; /* default */
+	return timeout;
+}
 
-	while ((opt = getopt(argc, argv, "imrsp:")) != -1) {
-		switch (opt) {
-		case 'i':
-			option.flag_inc = true;
-			break;
-		case 'm':
-			option.flag_mono = true;
+static void *output_thread(void *arg)
+{
+	struct output *o = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = o->in, .events = POLLIN },
+		{ .fd = output_wake[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		int rc = poll(pfd, NELEMENTS(pfd), output_timeout(o));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			perror("poll");
 			break;
-		case 'r':
-			option.flag_rel = true;
+		}
+
+		if (pfd[1].revents) {
+			wake_pipe_drain(output_wake);
+			if (output_reopen) {
+				output_reopen = 0;
+				o->pending = OUTPUT_REOPEN;
+			}
+		}
+
+		if (!pfd[0].revents) {
+			// Idle: close the frame and rotate if it is time.
+			output_check(o);
+			if (!output_end_frame(o) ||
+			    (o->pending != OUTPUT_KEEP && o->at_line_start && !output_switch(o)))
+				break;
+			continue;
+		}
+
+		// Uncompressed --mmap output is read straight into the
+		// window unless a switch has to split the data.
+		bool direct = o->opt->mmap && o->opt->compress == COMPRESS_NONE && o->pending == OUTPUT_KEEP;
+		unsigned char *buf = o->inbuf;
+		size_t len = OUTPUT_BUFSZ;
+
+		if (direct) {
+			if ((len = output_map(o)) == 0)
+				break;
+			buf = o->map + (o->size - o->map_off);
+			len = output_room(o, len);
+		}
+
+		ssize_t n = read(o->in, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("read");
 			break;
-		case 's':
-			option.flag_sincestart = true;
+		}
+		if (n == 0) {
+			if (output_end_frame(o))
+				return NULL;
 			break;
-		case 'p':
-			value = strtol(optarg, &value_endptr, 10);
-			if ((errno == ERANGE && (value == LONG_MAX || value == LONG_MIN)) || (errno != 0 && value == 0)) {
-				fprintf(stderr, "Error: -p %ld: %s.\n", value, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			if (value_endptr == optarg || *value_endptr != '\0' ||
-			    value < 1 || value >= TIME_UNIT_COUNT) {
-				fprintf(stderr, "Error: -p %ld is out of range. Valid values are between 1 and %d inclusive.\n", value, TIME_UNIT_COUNT-1);
-				exit(EXIT_FAILURE);
-			}
-			option.flag_precision = value;
+		}
+		if (!direct) {
+			if (!output_write(o, buf, n))
+				break;
+			continue;
+		}
+
+		o->size += n;
+		o->at_line_start = buf[n - 1] == '\n';
+		output_check(o);
+		if (o->pending != OUTPUT_KEEP && o->at_line_start && !output_switch(o))
 			break;
-		default:
-			fprintf(stderr, "Usage: ts [-r] [-i | -s] [-m] [-p precision] [format]\n");
+	}
+
+	// Writes to the pipe now fail with EPIPE (see stdout_pipe())
+	// rather than block forever.
+	o->failed = true;
+	close(o->in);
+	o->in = -1;
+	return NULL;
+}
+
+static bool output_init_compressor(struct output *o)
+{
+	int level = o->opt->compress_level;
+
+	switch (o->opt->compress) {
+#ifdef TS_ZLIB
+	case COMPRESS_GZIP:
+		if (level == INT_MIN)
+			level = Z_DEFAULT_COMPRESSION;
+		else if (level < 0 || level > 9) {
+			fprintf(stderr, "Error: --compress-level %d: gzip levels are 0 to 9.\n", level);
+			return false;
+		}
+		// 16 + the default window bits selects the gzip format.
+		if (deflateInit2(&o->gz, level, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "Error: deflateInit2 failed.\n");
+			return false;
+		}
+		return true;
+#endif
+#ifdef TS_ZSTD
+	case COMPRESS_ZSTD:
+		if (level == INT_MIN)
+			level = ZSTD_CLEVEL_DEFAULT;
+		else if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel() || level == 0) {
+			fprintf(stderr, "Error: --compress-level %d: zstd levels are %d to -1 and 1 to %d.\n",
+				level, ZSTD_minCLevel(), ZSTD_maxCLevel());
+			return false;
+		}
+		if ((o->zstd = ZSTD_createCCtx()) == NULL) {
+			fprintf(stderr, "Error: ZSTD_createCCtx failed.\n");
+			return false;
+		}
+		size_t rc = ZSTD_CCtx_setParameter(o->zstd, ZSTD_c_compressionLevel, level);
+		if (!ZSTD_isError(rc))
+			rc = ZSTD_CCtx_setParameter(o->zstd, ZSTD_c_checksumFlag, 1);
+		if (!ZSTD_isError(rc) && o->opt->compress_threads > 0)
+			rc = ZSTD_CCtx_setParameter(o->zstd, ZSTD_c_nbWorkers, o->opt->compress_threads);
+		if (ZSTD_isError(rc)) {
+			fprintf(stderr, "Error: zstd: %s.\n", ZSTD_getErrorName(rc));
+			return false;
+		}
+		return true;
+#endif
+	default:
+		(void)level;
+		return false;
+	}
+}
+
+// Points stdout at opt->output, through the output thread.
+static void output_open(const struct ts_opt *opt, struct output *o)
+{
+	*o = (struct output){ .opt = opt, .in = -1, .fd = -1, .at_line_start = true };
+
+	if (opt->mmap) {
+		// Windows are whole pages, and whole extents.
+		long page = sysconf(_SC_PAGESIZE);
+		o->window = opt->preallocate ? opt->preallocate : OUTPUT_MMAP_WINDOW;
+		o->window += (page - o->window % page) % page;
+
+		if ((o->syncer = calloc(1, sizeof(*o->syncer))) == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		if ((errno = pthread_mutex_init(&o->syncer->lock, NULL)) != 0 ||
+		    (errno = pthread_cond_init(&o->syncer->cond, NULL)) != 0 ||
+		    (errno = start_thread(&o->syncer->thread, output_syncer, o->syncer)) != 0) {
+			perror("output syncer");
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	if (option.flag_inc && option.flag_sincestart) {
-		fprintf(stderr, "Options '-i' and '-s' cannot be used together.\n");
+	o->inbuf = malloc(OUTPUT_BUFSZ);
+	o->outbuf = malloc(OUTPUT_BUFSZ);
+	if (o->inbuf == NULL || o->outbuf == NULL) {
+		perror("output buffer");
 		exit(EXIT_FAILURE);
 	}
 
-	/*
-	 * %b = Abbreviated month name
-	 * %d = The day of the month as a decimal number
-	 * %H = Hours
-	 * % %M = Minutes
-	 * % %S = Seconds
-	 */
-	const char *final_format = "%b %d %H:%M:%S";
+	if (!output_open_file(o))
+		exit(EXIT_FAILURE);
 
-	if (optind < argc) {
-		final_format = argv[optind];
+	if (opt->compress != COMPRESS_NONE && !output_init_compressor(o))
+		exit(EXIT_FAILURE);
+
+	o->in = stdout_pipe();
+	wake_pipe_open(output_wake, SIGHUP, output_hup_handler);
+	output_schedule(o);
+
+	if ((errno = start_thread(&o->thread, output_thread, o)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	if (option.flag_inc || option.flag_sincestart) {
-		// This is a departure from the moreutils version of
-		// ts. If we have a user-supplied format, then use
-		// that in preference to %H:%M:%S.
-		if (optind == argc) {
-			final_format = "%H:%M:%S";
+// Closes stdout and waits for the thread to write out what is left.
+// Returns false if any output was lost.
+static bool output_close(struct output *o)
+{
+	if (o->opt == NULL)
+		return true;
+
+	close(STDOUT_FILENO);
+	pthread_join(o->thread, NULL);
+
+	bool ok = output_close_file(o) && !o->failed;
+	if (o->in >= 0)
+		close(o->in);
+
+	struct output_syncer *s = o->syncer;
+	if (s != NULL) {
+		pthread_mutex_lock(&s->lock);
+		s->done = true;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+		ok &= !s->failed;
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+		free(s);
+	}
+
+	wake_pipe_close(output_wake);
+
+#ifdef TS_ZLIB
+	if (o->opt->compress == COMPRESS_GZIP)
+		deflateEnd(&o->gz);
+#endif
+#ifdef TS_ZSTD
+	ZSTD_freeCCtx(o->zstd);
+#endif
+	free(o->inbuf);
+	free(o->outbuf);
+
+	return ok;
+}
+
+// --ring SIZE
+//
+// A flight recorder: stdout becomes a pipe and a thread keeps the last
+// SIZE bytes of output in memory instead of writing them anywhere. The
+// ring is written to --ring-dump, a strftime(3) template expanded with
+// the time of the dump, and emptied:
+//
+//   - --after lines after a line that matches --trigger (a further
+//     match meanwhile starts the count again);
+//   - on SIGUSR2;
+//   - when ts exits.
+//
+// The trigger is matched against the line as written, timestamp
+// included. Whole lines are dropped from the front to make room, so
+// a dump starts at a line boundary.
+#define RING_MATCH_MAX (64 * 1024)
+
+struct ring {
+	const struct ts_opt *opt;
+	int in;			// Read end of the stdout pipe.
+	pthread_t thread;
+	unsigned char *inbuf;
+	unsigned char *buf;
+	size_t size;
+	size_t start;		// Offset of the oldest byte.
+	size_t len;
+	bool overwritten;	// The oldest line may have lost its start.
+	pcre2_code *trigger;
+	pcre2_match_data *match_data;
+	unsigned char *line;	// A line split across reads, for matching.
+	size_t line_len;
+	unsigned long long after;	// Lines to go before a dump.
+	bool triggered;
+	bool failed;
+};
+
+static volatile sig_atomic_t ring_dump_requested;
+static int ring_wake[2] = { -1, -1 };	// The SIGUSR2 pipe.
+
+static void ring_usr2_handler(int sig)
+{
+	(void)sig;
+	ring_dump_requested = 1;
+	wake_pipe_poke(ring_wake);
+}
+
+// Appends data, overwriting the oldest bytes if need be.
+static void ring_put(struct ring *r, const unsigned char *data, size_t len)
+{
+	if (len >= r->size) {
+		data += len - r->size;
+		len = r->size;
+		r->start = 0;
+		r->len = 0;
+		r->overwritten = true;
+	}
+
+	if (r->len + len > r->size) {
+		size_t drop = r->len + len - r->size;
+		r->start = (r->start + drop) % r->size;
+		r->len -= drop;
+		r->overwritten = true;
+	}
+
+	size_t end = (r->start + r->len) % r->size;
+	size_t n = r->size - end < len ? r->size - end : len;
+	memcpy(r->buf + end, data, n);
+	memcpy(r->buf, data + n, len - n);
+	r->len += len;
+}
+
+// Writes the ring to a new --ring-dump file and empties it.
+static bool ring_dump(struct ring *r)
+{
+	struct timespec now;
+	struct tm tm;
+	char path[PATH_MAX];
+
+	r->triggered = false;
+
+	// Skip what is left of a line whose start was overwritten.
+	while (r->overwritten && r->len > 0) {
+		bool nl = r->buf[r->start] == '\n';
+		r->start = (r->start + 1) % r->size;
+		r->len--;
+		r->overwritten = !nl;
+	}
+	r->overwritten = false;
+
+	if (r->len == 0)
+		return true;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (localtime_r(&now.tv_sec, &tm) == NULL ||
+	    strftime(path, sizeof(path), r->opt->ring_dump, &tm) == 0) {
+		fprintf(stderr, "Error: --ring-dump %s: cannot format the time.\n", r->opt->ring_dump);
+		return false;
+	}
+
+	size_t n = r->size - r->start < r->len ? r->size - r->start : r->len;
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	bool ok = fd >= 0 && write_all(fd, r->buf + r->start, n) && write_all(fd, r->buf, r->len - n);
+
+	if (!ok)
+		perror(path);
+	if (fd >= 0 && close(fd) != 0 && ok) {
+		perror(path);
+		ok = false;
+	}
+
+	r->start = 0;
+	r->len = 0;
+	return ok;
+}
+
+// Counts down to a dump after a trigger, or starts counting.
+static bool ring_line(struct ring *r, const unsigned char *line, size_t len)
+{
+	if (r->trigger != NULL &&
+	    pcre2_match(r->trigger, line, len, 0, 0, r->match_data, NULL) >= 0) {
+		r->triggered = true;
+		r->after = r->opt->ring_after;
+	} else if (r->triggered && r->after > 0) {
+		r->after--;
+	}
+
+	return !r->triggered || r->after > 0 || ring_dump(r);
+}
+
+// Records a chunk of output, matching each complete line against the
+// trigger once it is in the ring.
+static bool ring_write(struct ring *r, const unsigned char *data, size_t len)
+{
+	const unsigned char *nl;
+
+	while ((nl = memchr(data, '\n', len)) != NULL) {
+		size_t n = nl - data;
+		ring_put(r, data, n + 1);
+
+		const unsigned char *line = data;
+		if (r->line_len > 0) {
+			size_t room = RING_MATCH_MAX - r->line_len;
+			memcpy(r->line + r->line_len, data, n < room ? n : room);
+			line = r->line;
+			n = r->line_len + (n < room ? n : room);
+			r->line_len = 0;
 		}
-		setenv("TZ", "GMT", 1);
-		tzset();
+		if (!ring_line(r, line, n))
+			return false;
+
+		len -= nl + 1 - data;
+		data = nl + 1;
 	}
 
-	option.format = final_format;
-	option.hires_timestamping = count_microsecond_specifiers(option.format) > 0 || option.flag_mono;
-	option.user_format_specified = optind < argc;
+	ring_put(r, data, len);
+	size_t room = RING_MATCH_MAX - r->line_len;
+	memcpy(r->line + r->line_len, data, len < room ? len : room);
+	r->line_len += len < room ? len : room;
+	return true;
+}
+
+static void *ring_thread(void *arg)
+{
+	struct ring *r = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = r->in, .events = POLLIN },
+		{ .fd = ring_wake[0], .events = POLLIN },
+	};
+	for (;;) {
+		int rc = poll(pfd, NELEMENTS(pfd), -1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			perror("poll");
+			break;
+		}
+
+		if (pfd[1].revents) {
+			wake_pipe_drain(ring_wake);
+			if (ring_dump_requested) {
+				ring_dump_requested = 0;
+				r->failed |= !ring_dump(r);
+			}
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		ssize_t n = read(r->in, r->inbuf, OUTPUT_BUFSZ);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("read");
+			break;
+		}
+		if (n == 0)
+			return NULL;
+		r->failed |= !ring_write(r, r->inbuf, n);
+	}
+
+	// Writes to the pipe now fail with EPIPE (see stdout_pipe())
+	// rather than block forever.
+	r->failed = true;
+	close(r->in);
+	r->in = -1;
+	return NULL;
+}
+
+// Points stdout at the ring, through the ring thread.
+static void ring_open(const struct ts_opt *opt, struct ring *r)
+{
+	*r = (struct ring){ .opt = opt, .in = -1, .size = opt->ring };
+
+	r->inbuf = malloc(OUTPUT_BUFSZ);
+	r->buf = malloc(r->size);
+	r->line = malloc(RING_MATCH_MAX);
+	if (r->inbuf == NULL || r->buf == NULL || r->line == NULL) {
+		perror("--ring");
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt->ring_trigger != NULL) {
+		r->trigger = must_compile_user_regex("trigger", opt->ring_trigger);
+		r->match_data = pcre2_match_data_create_from_pattern(r->trigger, NULL);
+		if (r->match_data == NULL) {
+			fprintf(stderr, "Error: --trigger: cannot allocate match data.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r->in = stdout_pipe();
+	wake_pipe_open(ring_wake, SIGUSR2, ring_usr2_handler);
+
+	if ((errno = start_thread(&r->thread, ring_thread, r)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Closes stdout, waits for the thread to record what is left and
+// dumps the ring. Returns false if any dump failed.
+static bool ring_close(struct ring *r)
+{
+	if (r->opt == NULL)
+		return true;
+
+	close(STDOUT_FILENO);
+	pthread_join(r->thread, NULL);
+
+	bool ok = ring_dump(r) && !r->failed;
+	if (r->in >= 0)
+		close(r->in);
+
+	wake_pipe_close(ring_wake);
+
+	pcre2_match_data_free(r->match_data);
+	pcre2_code_free(r->trigger);
+	free(r->line);
+	free(r->buf);
+	free(r->inbuf);
+
+	return ok;
+}
+
+// --lossy BYTES
+//
+// Stdout becomes a pipe that a reader thread drains into a BYTES
+// buffer, and a writer thread copies the buffer to the real stdout.
+// When the consumer stalls the buffer fills up, and from then on each
+// new line that does not fit is dropped whole rather than blocking ts
+// and, through its input, whatever produces the lines. Lines are only
+// dropped while the writer is waiting for stdout to take more: as
+// long as it keeps taking data, the reader waits for room instead, so
+// a consumer that keeps up loses nothing. Once there is
+// room again a marker line reporting the drops goes out before the
+// next line. A line that has been started is always finished, waiting
+// for room if need be, so lines are never cut short.
+//
+// The totals are reported on stderr at exit, and each marker fires
+// the lines_dropped USDT probe.
+enum lossy_state {
+	LOSSY_LINE_START,
+	LOSSY_KEEP,		// In a line that is being kept.
+	LOSSY_DROP,		// In a line that is being dropped.
+};
+
+struct lossy {
+	int in;			// Read end of the stdout pipe.
+	int out;		// What stdout was.
+	pthread_t reader;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *inbuf;
+	unsigned char *buf;
+	size_t size;
+	size_t start;		// Offset of the oldest byte.
+	size_t len;
+	size_t chunk;		// Most to write at once.
+	bool done;		// The reader has finished.
+	bool failed;		// Writing failed.
+	bool blocked;		// The writer is waiting for stdout.
+	enum lossy_state state;
+
+	// Drops since the last marker.
+	unsigned long long dropped;
+	unsigned long long dropped_bytes;
+	struct timespec first_drop;
+	struct timespec last_drop;
+
+	unsigned long long total_lines;
+	unsigned long long total_bytes;
+	unsigned long long bursts;
+};
+
+// Copies data into the buffer, which must have room for it.
+static void lossy_put(struct lossy *l, const void *data, size_t len)
+{
+	size_t end = (l->start + l->len) % l->size;
+	size_t n = l->size - end < len ? l->size - end : len;
+
+	memcpy(l->buf + end, data, n);
+	memcpy(l->buf, (const unsigned char *)data + n, len - n);
+	l->len += len;
+}
+
+// Formats the marker for the drops since the last one.
+static size_t lossy_marker(const struct lossy *l, char *buf, size_t size)
+{
+	char from[32], to[32];
+	struct tm tm;
+
+	strftime(from, sizeof(from), "%FT%T", localtime_r(&l->first_drop.tv_sec, &tm));
+	strftime(to, sizeof(to), "%FT%T", localtime_r(&l->last_drop.tv_sec, &tm));
+
+	int n = snprintf(buf, size, "ts: %llu lines dropped between %s and %s\n", l->dropped, from, to);
+	return n < (int)size ? (size_t)n : size - 1;
+}
+
+// Puts the marker in the buffer, which must have room for it.
+static void lossy_report(struct lossy *l, const char *marker, size_t len)
+{
+	lossy_put(l, marker, len);
+	TS_PROBE2(lines_dropped, l->dropped, l->dropped_bytes);
+	l->total_lines += l->dropped;
+	l->total_bytes += l->dropped_bytes;
+	l->bursts++;
+	l->dropped = 0;
+	l->dropped_bytes = 0;
+}
 
-	return option;
+// Waits for len bytes of room, or for the writer to fail. Called with
+// the lock held.
+static bool lossy_wait(struct lossy *l, size_t len)
+{
+	while (l->size - l->len < len && !l->failed)
+		pthread_cond_wait(&l->cond, &l->lock);
+	return !l->failed;
 }
 
-static void test_precision_variations(void)
+// Queues or drops a piece of a line; ends is set if it ends the line.
+static void lossy_piece(struct lossy *l, const unsigned char *data, size_t len, bool ends)
 {
-	composite_time comp_time;
-	time_t timestamp;
+	char marker[128];
+	size_t marker_len = 0;
 
-	// Test rounding up with precision level 3; hours increase due
-	// to minutes and seconds.
-	COMP_TIME_INIT(comp_time, 1, 2, 3, 45, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 1, 2, 4, 0, 0);
+	if (l->state == LOSSY_DROP) {
+		l->dropped_bytes += len;
+		l->state = ends ? LOSSY_LINE_START : LOSSY_DROP;
+		return;
+	}
 
-	// Test detailed representation with precision level 4;
-	// minutes increase due to seconds.
-	COMP_TIME_INIT(comp_time, 1, 2, 3, 45, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 1, 2, 3, 46, 0);
+	if (l->state == LOSSY_LINE_START && l->dropped > 0)
+		marker_len = lossy_marker(l, marker, sizeof(marker));
+
+	pthread_mutex_lock(&l->lock);
+
+	// A new line that does not fit waits for room unless the writer
+	// is blocked. An empty buffer means that output is keeping up, so
+	// even a line that is larger than the room left is kept then.
+	while (l->state == LOSSY_LINE_START && l->len > 0 && l->size - l->len < marker_len + len &&
+	       !l->blocked && !l->failed)
+		pthread_cond_wait(&l->cond, &l->lock);
+
+	if (l->state == LOSSY_LINE_START && l->len > 0 && l->size - l->len < marker_len + len && l->blocked) {
+		pthread_mutex_unlock(&l->lock);
+		clock_gettime(CLOCK_REALTIME, &l->last_drop);
+		if (l->dropped++ == 0)
+			l->first_drop = l->last_drop;
+		l->dropped_bytes += len;
+		l->state = ends ? LOSSY_LINE_START : LOSSY_DROP;
+		return;
+	}
 
-	// Test with 59 minutes, 59 seconds at precision level 4;
-	// expecting no change since all units are significant.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 59, 59);
+	if (marker_len > 0 && lossy_wait(l, marker_len))
+		lossy_report(l, marker, marker_len);
 
-	// Test with 1 hour, 59 minutes, 59 seconds at precision level
-	// 3; expecting no change as rounding not applied due to
-	// precision.
-	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 1, 59, 59);
+	// The rest of a line longer than the room left waits for it.
+	while (len > 0 && lossy_wait(l, 1)) {
+		size_t n = l->size - l->len < len ? l->size - l->len : len;
+		lossy_put(l, data, n);
+		data += n;
+		len -= n;
+		pthread_cond_broadcast(&l->cond);
+	}
 
-	// Test rounding up from minutes to hours with precision level
-	// 2; hours should increase, minutes reset.
-	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 2, 0, 0);
+	pthread_mutex_unlock(&l->lock);
+	l->state = ends ? LOSSY_LINE_START : LOSSY_KEEP;
+}
 
-	// Simplify to most significant unit (days) with precision
-	// level 1 from days, hours, and minutes.
-	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	assert(timestamp == 95310);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(1, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+static void *lossy_reader(void *arg)
+{
+	struct lossy *l = arg;
 
-	// Retain days and hours with precision level 2, simplifying
-	// minutes and seconds.
-	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	assert(timestamp == 95310);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 0, 0);
+	for (;;) {
+		ssize_t n = read(l->in, l->inbuf, OUTPUT_BUFSZ);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			perror("read");
+		if (n <= 0)
+			break;
 
-	// Retain days, hours, and approximate minutes with precision
-	// level 3.
-	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	assert(timestamp == 95310);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 29, 0);
+		const unsigned char *p = l->inbuf;
+		const unsigned char *end = p + n;
+		while (p < end) {
+			const unsigned char *nl = memchr(p, '\n', end - p);
+			const unsigned char *next = nl != NULL ? nl + 1 : end;
+			lossy_piece(l, p, next - p, nl != NULL);
+			p = next;
+		}
 
-	// Full detail maintained with precision level 4, no
-	// approximation.
-	COMP_TIME_INIT(comp_time, 0, 1, 2, 28, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	assert(timestamp == 95310);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 2, 28, 30);
+		pthread_mutex_lock(&l->lock);
+		bool failed = l->failed;
+		pthread_mutex_unlock(&l->lock);
+		if (failed)
+			break;
+	}
 
-	// Test high precision with minimal input (1 second), expecting no approximation.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 1);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 1);
+	// Writes to the pipe now fail with EPIPE (see stdout_pipe())
+	// rather than block forever.
+	close(l->in);
+	l->in = -1;
 
-	// Test for minute to hour rollover with precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 0, 1, 59, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 2, 0, 0);
+	char marker[128];
+	size_t marker_len = l->dropped > 0 ? lossy_marker(l, marker, sizeof(marker)) : 0;
 
-	// Test for no change with hours near maximum but within
-	// precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 0, 23, 45, 0);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 23, 45, 0);
+	pthread_mutex_lock(&l->lock);
+	if (marker_len > 0 && lossy_wait(l, marker_len))
+		lossy_report(l, marker, marker_len);
+	l->done = true;
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
 
-	// Test day to year rollover with precision level 2; days
-	// reset, year increments.
-	COMP_TIME_INIT(comp_time, 1, 364, 23, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 2, 0, 0, 0, 0);
+	return NULL;
+}
 
-	// Test handling when non-zero units exceed precision level 2;
-	// hours and less significant units reset.
-	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+// Writes out part of the buffer. If stdout cannot take more right
+// now, the reader is told to drop lines until it can.
+static bool lossy_write(struct lossy *l, const void *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = l->out, .events = POLLOUT };
 
-	// Test handling when all units are set to zero, with precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 0);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 0);
+	if (poll(&pfd, 1, 0) == 0) {
+		pthread_mutex_lock(&l->lock);
+		l->blocked = true;
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
 
-	// Test edge case for seconds rolling over to minutes, with
-	// precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 59, 59);
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
 
-	// Test high precision with minimal input (1 second), expecting no approximation.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 0, 1);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 0, 1);
+		pthread_mutex_lock(&l->lock);
+		l->blocked = false;
+		pthread_mutex_unlock(&l->lock);
+	}
 
-	// Test rollover across multiple units (seconds to minutes to
-	// hours), with precision level 3.
-	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 23, 59, 59);
+	return write_all(l->out, buf, len);
+}
 
-	// Test mixed zero and non-zero units, with precision level 2.
-	COMP_TIME_INIT(comp_time, 1, 0, 1, 0, 1);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 1, 0, 1, 0, 0);
+static void *lossy_writer(void *arg)
+{
+	struct lossy *l = arg;
 
-	// Test days to years rollover with minimal hours input, with
-	// precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 364, 23, 0, 0);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 364, 23, 0, 0);
+	pthread_mutex_lock(&l->lock);
+	for (;;) {
+		while (l->len == 0 && !l->done)
+			pthread_cond_wait(&l->cond, &l->lock);
+		if (l->len == 0)
+			break;
 
-	// Test with maximum values just before rollover for each
-	// unit, with precision level 4. Expecting no change with
-	// precision 4, as all units are significant.
-	COMP_TIME_INIT(comp_time, 0, 364, 23, 59, 59);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
+		size_t n = l->size - l->start < l->len ? l->size - l->start : l->len;
+		if (n > l->chunk)
+			n = l->chunk;
+		pthread_mutex_unlock(&l->lock);
+		bool ok = lossy_write(l, l->buf + l->start, n);
+		if (!ok)
+			perror("write");
+		pthread_mutex_lock(&l->lock);
 
-	COMP_TIME_ASSERT(comp_time, 0, 364, 23, 59, 59);
+		if (!ok) {
+			l->failed = true;
+			pthread_cond_broadcast(&l->cond);
+			break;
+		}
+		l->start = (l->start + n) % l->size;
+		l->len -= n;
+		pthread_cond_broadcast(&l->cond);
+	}
+	pthread_mutex_unlock(&l->lock);
 
-	// Test handling of cascading rollover from minutes to hours
-	// to days, with precision level 2.
-	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(2, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+	return NULL;
+}
 
-	// Test transition at midnight with precision level 3.
-	COMP_TIME_INIT(comp_time, 0, 0, 23, 59, 60);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 1, 0, 0, 0);
+// Puts the buffer and its threads between stdout and whatever it was.
+static void lossy_open(const struct ts_opt *opt, struct lossy *l)
+{
+	*l = (struct lossy){ .in = -1, .out = -1, .size = opt->lossy };
 
-	// Test with minimal non-zero units and lower precision.
-	COMP_TIME_INIT(comp_time, 0, 0, 0, 1, 30);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(1, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 0, 2, 0);
+	l->inbuf = malloc(OUTPUT_BUFSZ);
+	l->buf = malloc(l->size);
+	if (l->inbuf == NULL || l->buf == NULL) {
+		perror("--lossy");
+		exit(EXIT_FAILURE);
+	}
 
-	// Test sparse non-zero units with high precision.
-	COMP_TIME_INIT(comp_time, 1, 0, 0, 0, 5);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(4, comp_time);
-	COMP_TIME_ASSERT(comp_time, 1, 0, 0, 0, 5);
+	struct stat st;
+	if ((l->out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0)) < 0 || fstat(l->out, &st) != 0) {
+		perror("dup");
+		exit(EXIT_FAILURE);
+	}
+	l->in = stdout_pipe();
 
-	// Test rounding in the middle of the spectrum with precision
-	// 3. Assuming no change as it's already concise.
-	COMP_TIME_INIT(comp_time, 0, 0, 12, 30, 0);
-	timestamp = composite_time_to_seconds(comp_time);
-	seconds_to_composite_time(timestamp, comp_time);
-	approximate_time(3, comp_time);
-	COMP_TIME_ASSERT(comp_time, 0, 0, 12, 30, 0);
-}
+	// Once poll(2) reports a pipe writable, PIPE_BUF bytes go in
+	// without blocking; a regular file never blocks for long.
+	l->chunk = S_ISREG(st.st_mode) ? l->size : PIPE_BUF;
 
-static volatile sig_atomic_t signal_received;
+	if ((errno = pthread_mutex_init(&l->lock, NULL)) != 0 ||
+	    (errno = pthread_cond_init(&l->cond, NULL)) != 0 ||
+	    (errno = start_thread(&l->writer, lossy_writer, l)) != 0 ||
+	    (errno = start_thread(&l->reader, lossy_reader, l)) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
 
-static void signal_handler(int sig)
+// Closes stdout, waits for what is buffered to be written and puts
+// the original stdout back. Returns false if writing failed.
+static bool lossy_close(struct lossy *l)
 {
-	signal_received = sig;
+	if (l->buf == NULL)
+		return true;
+
+	close(STDOUT_FILENO);
+	pthread_join(l->reader, NULL);
+	pthread_join(l->writer, NULL);
+
+	if (l->total_lines > 0)
+		fprintf(stderr, "ts: dropped %llu lines (%llu bytes) in %llu bursts.\n",
+			l->total_lines, l->total_bytes, l->bursts);
+
+	bool ok = !l->failed;
+	if (dup2(l->out, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		ok = false;
+	}
+	close(l->out);
+
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->cond);
+	free(l->inbuf);
+	free(l->buf);
+
+	return ok;
 }
 
 int main(int argc, char *argv[])
 {
 	test_precision_variations();
+	test_binary_encoding();
+	test_json_escape();
 
 	struct sigaction sa_sigint;
 	sa_sigint.sa_handler = signal_handler;
@@ -1040,6 +7162,20 @@ int main(int argc, char *argv[])
 
 	struct ts_opt opt = parse_options(argc, argv);
 	struct ts_fmt fmt = { .opt = &opt };
+	struct output output = { 0 };
+	struct ring ring = { 0 };
+	struct lossy lossy = { 0 };
+
+	must_init_filters(&opt, &fmt);
+
+	if (opt.output != NULL)
+		output_open(&opt, &output);
+	if (opt.shard != NULL)
+		fmt.shards = shards_init(&opt);
+	if (opt.ring != 0)
+		ring_open(&opt, &ring);
+	if (opt.lossy != 0)
+		lossy_open(&opt, &lossy);
 
 	long secs = 0;
 	long nsecs = 0;
@@ -1067,44 +7203,87 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	char *line = NULL;
-	ssize_t line_len;
-	size_t line_capacity = 0;
+	// With TZ unset glibc's mktime(3) re-reads the zone and
+	// strdup(3)s its name on every call; naming the default zone
+	// file explicitly makes that a no-op after the first call.
+	if (getenv("TZ") == NULL)
+		setenv("TZ", ":/etc/localtime", 1);
 
-	while (!signal_received) {
-		line_len = getline(&line, &line_capacity, stdin);
+	// Neither localtime_r() nor strftime(3) are required to call
+	// tzset().
+	tzset();
 
-		if (line_len == -1) {
-			if ((errno == EINTR && signal_received) || feof(stdin)) {
-				break;
-			} else if (errno != EINTR) {
-				perror("getline");
-				break;
-			}
-		}
+	struct stamp_source input = { .out = stdout };
 
-		struct timespec now;
-		if (!gettime(&opt, &now, &secs, &nsecs, monodelta)) {
-			perror("gettime");
-			break;
-		}
+	// One extra byte so that a line of exactly max_line_bytes,
+	// including its newline, is never split.
+	if (!line_reader_init(&input.reader, STDIN_FILENO, LINE_BUFSZ, opt.max_line_bytes ? opt.max_line_bytes + 1 : 0)) {
+		perror("line buffer");
+		exit(EXIT_FAILURE);
+	}
 
-		size_t offset = 0;
+	if (opt.command == NULL && opt.ninputs == 0 && !opt.decode && opt.query == NULL && opt.gen.family == NULL)
+		line_reader_decompress(&input.reader, "stdin");
 
-		if (opt.flag_rel)
-			fmt_time_rel(&fmt, line, line_len, &offset, now);
-		else
-			fmt_time_now(&fmt, now);
+	size_t gen_bufsz = opt.gen.len_max + GEN_HEADROOM;
+	char *gen_buf = NULL;
 
-		if (printf("%s%s%s", fmt.buf, opt.flag_rel ? "" : " ", line + offset) < 0) {
-			perror("write");
-			break;
-		}
+	if (opt.gen.family != NULL && (gen_buf = malloc(gen_bufsz)) == NULL) {
+		perror("line buffer");
+		exit(EXIT_FAILURE);
 	}
 
-	free(line);
+	// Room to escape any line that fits the initial line buffer,
+	// so that typical input never grows it.
+	fmt.jsonsz = opt.json ? 6 * LINE_BUFSZ + MAX_TIME_BUFSZ : 0;
+	if (fmt.jsonsz != 0 && (fmt.json = malloc(fmt.jsonsz)) == NULL) {
+		perror("json buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt.binary && !write_binary_header(stdout, opt.binary)) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	int exit_status = EXIT_SUCCESS;
+
+	if (opt.command != NULL)
+		exit_status = run_command(&opt, &fmt, &secs, &nsecs, monodelta);
+	else if (opt.merge)
+		merge_inputs(&opt, &fmt, &secs, &nsecs, monodelta);
+	else if (opt.ninputs > 0)
+		stamp_inputs(&opt, &fmt, &secs, &nsecs, monodelta);
+	else if (opt.decode)
+		exit_status = decode_records(&fmt) ? EXIT_SUCCESS : EXIT_FAILURE;
+	else if (opt.archive != NULL)
+		archive_lines(&opt, &input.reader);
+	else if (opt.query != NULL)
+		exit_status = query_archive(&opt, &fmt) ? EXIT_SUCCESS : EXIT_FAILURE;
+	else if (opt.range)
+		extract_range(&opt, &input.reader);
+	else if (opt.reorder)
+		reorder_lines(&opt, &input.reader);
+	else if (opt.replay)
+		replay(&input.reader, opt.replay_speed);
+	else if (opt.gen.family != NULL)
+		generate_lines(&opt, &fmt, gen_buf, gen_bufsz, &secs, &nsecs, monodelta);
+	else
+		stamp_lines(&opt, &fmt, &input, &secs, &nsecs, monodelta);
+
+	if (!ALLOC_CHECK_DONE())
+		exit(EXIT_FAILURE);
+
+	line_reader_free(&input.reader);
+	free(opt.inputs);
+	free(gen_buf);
 	free(fmt.sanitised_time_format);
+	free(fmt.json);
 	free(fmt.buf);
+	free_filters(&opt, &fmt);
+	free(opt.match);
+	free(opt.exclude);
+	free(opt.tz);
 
 	for (size_t i = 0; i < NELEMENTS(timestamps); i++) {
 		pcre2_code_free(timestamps[i].pcre);
@@ -1116,5 +7295,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	return EXIT_SUCCESS;
+	// --lossy writes into --output or --ring, so goes first.
+	if (!lossy_close(&lossy))
+		exit_status = EXIT_FAILURE;
+	if (!output_close(&output) || !ring_close(&ring) || !shards_free(fmt.shards) || input_corrupt)
+		exit_status = EXIT_FAILURE;
+
+	return exit_status;
 }